@@ -0,0 +1,52 @@
+#!/bin/sh
+# Benchmarks picasso on generated shader corpora, run with "make bench".
+# The corpora only depend on the settings below, so results of different
+# builds on the same machine can be compared. Each configuration is run
+# BENCH_RUNS times and the fastest run is reported.
+set -e
+
+PICASSO=${PICASSO:-./picasso}
+SHADERGEN=${SHADERGEN:-./picasso-shadergen}
+RUNS=${BENCH_RUNS:-10}
+DIR=${BENCH_DIR:-bench}
+
+# name files size mix
+CONFIGS="
+single 1 400 60,20,20
+many 16 220 60,20,20
+large 4 900 60,20,20
+alu 8 440 80,20,0
+flow 8 440 30,10,60
+"
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+
+$PICASSO --version
+echo "runs per configuration: $RUNS (fastest reported), times in ms"
+printf "%-8s %-3s %7s %6s %9s %9s %9s %9s %9s %9s %9s %9s\n" \
+	config opt lines insns assemble fixup relocate write total "Mlines/s" "Minsns/s" "rss KiB"
+
+echo "$CONFIGS" | while read name files size mix; do
+	[ -n "$name" ] || continue
+	mkdir -p "$DIR/$name"
+	$SHADERGEN -o "$DIR/$name" -n "$files" -s "$size" -m "$mix" -r 1 >/dev/null
+
+	for opt in 0 2; do
+		: > "$DIR/runs.txt"
+		i=0
+		while [ $i -lt "$RUNS" ]; do
+			$PICASSO -O$opt --timings -o "$DIR/$name.shbin" "$DIR/$name"/shader* 2> "$DIR/timings.txt"
+			# total lines insns assemble fixup relocate write total rss
+			awk '$1 == "peak" { rss = $3 } $2 ~ /^[0-9.]+$/ { v[$1] = $2 }
+				END { print v["total:"], v["lines:"], v["insns:"], v["assemble:"], v["fixup:"], v["relocate:"], v["write:"], v["total:"], rss == "" ? "-" : rss }' \
+				"$DIR/timings.txt" >> "$DIR/runs.txt"
+			i=$((i+1))
+		done
+
+		sort -n "$DIR/runs.txt" | head -n 1 | awk -v name="$name" -v opt="-O$opt" '{
+			t = $8 > 0 ? $8 : 0.001
+			printf "%-8s %-3s %7d %6d %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9s\n",
+				name, opt, $2, $3, $4, $5, $6, $7, $8, $2/t/1e3, $3/t/1e3, $9 }'
+	done
+done
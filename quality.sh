@@ -0,0 +1,126 @@
+#!/bin/sh
+# Checks the code generated by picasso for the shaders in the quality
+# directory, run with "make quality". Each shader is assembled at every
+# optimization level, and picasso-sim checks that the outputs of every build
+# match the -O0 build on the recorded input stream. The size of the program,
+# its operand descriptors and its estimated cost are then compared with the
+# baseline file; "make quality-baseline" writes a new one instead.
+set -e
+
+PICASSO=${PICASSO:-./picasso}
+PICASSO_SIM=${PICASSO_SIM:-./picasso-sim}
+SRC=${1:-quality}
+DIR=${QUALITY_DIR:-quality-out}
+BASELINE=$SRC/baseline.txt
+
+# name files...
+SHADERS="
+skinning skinning.vsh common.vsh
+lighting lighting.vsh common.vsh
+particles_point particles_point.gsh
+particles_variable particles_variable.gsh
+particles_fixed particles_fixed.gsh
+mesh_variants mesh_variants.vsh
+"
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+
+# Number of DVLEs in a SHBIN file
+shbin_dvles()
+{
+	od -An -tu4 -j4 -N4 "$1" | tr -d ' '
+}
+
+# Program words and operand descriptors in the DVLP of a SHBIN file
+shbin_sizes()
+{
+	od -An -tu4 -j$((8 + 4*$(shbin_dvles "$1") + 12)) -N12 "$1" | awk '{ print $1, $3 }'
+}
+
+: > "$DIR/results.txt"
+echo "$SHADERS" | while read name files; do
+	[ -n "$name" ] || continue
+	srcs=
+	for f in $files; do
+		srcs="$srcs $SRC/$f"
+	done
+
+	for opt in 0 1 2 3; do
+		out="$DIR/$name-O$opt"
+		$PICASSO -O$opt --cost-report -o "$out.shbin" $srcs > "$out.cost"
+		sizes=$(shbin_sizes "$out.shbin")
+
+		# Variants are listed as <name>:<dvle>
+		dvle=0
+		dvles=$(shbin_dvles "$out.shbin")
+		while [ $dvle -lt "$dvles" ]; do
+			row=$name
+			[ $dvle -eq 0 ] || row=$name:$dvle
+
+			# Outputs must match the unoptimized build
+			if ! $PICASSO_SIM -q -e $dvle -i "$SRC/$name.stream" -c "$out.shbin" "$DIR/$name-O0.shbin" > "$out.sim" 2>&1; then
+				echo "$row -O$opt: outputs differ from -O0:" >&2
+				cat "$out.sim" >&2
+				echo "$row -O$opt" >> "$DIR/failed.txt"
+			fi
+
+			cost=$(awk -v dvle=$dvle '$1 == "dvle" { n = $2 } n == dvle && /^  total:/ { split($4, c, "[.][.]"); print c[1], c[2]; exit }' "$out.cost")
+			mean=$(awk '$1 == "B" && $2 == "cycles" { print $3 }' "$out.sim")
+			echo "$row -O$opt $sizes $cost ${mean:--}" >> "$DIR/results.txt"
+			dvle=$((dvle+1))
+		done
+	done
+done
+
+if [ -n "$QUALITY_UPDATE" ]; then
+	{
+		echo "# Generated by make quality-baseline"
+		echo "# shader opt words opdescs min_cycles max_cycles mean_cycles"
+		cat "$DIR/results.txt"
+	} > "$BASELINE"
+	echo "wrote $BASELINE"
+fi
+
+status=0
+
+# Print each figure with its change from the baseline, and fail if any grew
+# or if the measured mean is above the worst case given by the cost report
+awk -v baseline="$BASELINE" '
+	BEGIN {
+		while ((getline line < baseline) > 0) {
+			if (line ~ /^#/) continue
+			n = split(line, f, " ")
+			for (i = 3; i <= n; i ++) base[f[1] " " f[2], i] = f[i]
+			known[f[1] " " f[2]] = 1
+		}
+		print "figures marked + are worse than the baseline, those marked - are better"
+		printf "%-20s %-3s %9s %9s %9s %9s %11s\n", "shader", "opt", "words", "opdescs", "min cyc", "max cyc", "mean cyc"
+	}
+	{
+		key = $1 " " $2
+		printf "%-20s %-3s", $1, $2
+		for (i = 3; i <= 7; i ++) {
+			s = $i
+			if (known[key] && $i != "-" && base[key, i] != "-") {
+				d = $i - base[key, i]
+				if (d > 0.005) { s = s "+"; worse[key] = worse[key] " " i }
+				else if (d < -0.005) s = s "-"
+			}
+			printf " %" (i == 7 ? 11 : 9) "s", s
+		}
+		if ($6 != "-" && $7 != "-" && $7 - $6 > 0.005) above[key] = 1
+		printf "%s\n", known[key] ? "" : "  (not in baseline)"
+	}
+	END {
+		bad = 0
+		for (key in worse) { print "regression: " key; bad = 1 }
+		for (key in above) { print "mean cycles above the worst case: " key; bad = 1 }
+		exit bad
+	}' "$DIR/results.txt" || status=1
+
+if [ -f "$DIR/failed.txt" ]; then
+	sed 's/^/miscompile: /' "$DIR/failed.txt"
+	status=1
+fi
+exit $status
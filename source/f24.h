@@ -0,0 +1,75 @@
+#pragma once
+#include <string.h>
+#include "types.h"
+
+// f24 has:
+//  - 1 sign bit
+//  - 7 exponent bits
+//  - 16 mantissa bits
+
+static inline uint32_t f32tof24(float f)
+{
+	uint32_t i;
+	memcpy(&i, &f, sizeof(f));
+
+	uint32_t mantissa = (i << 9) >>  9;
+	int32_t  exponent = (i << 1) >> 24;
+	uint32_t sign     = (i << 0) >> 31;
+
+	// Truncate mantissa
+	mantissa >>= 7;
+
+	// Re-bias exponent
+	exponent = exponent - 127 + 63;
+	if (exponent < 0)
+	{
+		// Underflow: flush to zero
+		return sign << 23;
+	}
+	else if (exponent > 0x7F)
+	{
+		// Overflow: saturate to infinity
+		return (sign << 23) | (0x7F << 16);
+	}
+
+	return (sign << 23) | (exponent << 16) | mantissa;
+}
+
+static inline float f24tof32(uint32_t f)
+{
+	uint32_t mantissa = f & 0xFFFF;
+	uint32_t exponent = (f >> 16) & 0x7F;
+	uint32_t sign     = (f >> 23) & 1;
+	uint32_t i;
+
+	if (!exponent && !mantissa)
+		i = sign << 31;
+	else if (exponent == 0x7F)
+		i = (sign << 31) | (0xFF << 23) | (mantissa << 7);
+	else
+		i = (sign << 31) | ((exponent - 63 + 127) << 23) | (mantissa << 7);
+
+	float ret;
+	memcpy(&ret, &i, sizeof(ret));
+	return ret;
+}
+
+// Reduces a value to f24 precision, same as f24tof32(f32tof24(f)) but without
+// branches so that loops using it can be vectorized
+static inline float f24round(float f)
+{
+	uint32_t i, sign, exponent;
+	memcpy(&i, &f, sizeof(f));
+
+	sign     = i & 0x80000000;
+	exponent = (i >> 23) & 0xFF;
+	i &= 0xFFFFFF80;
+
+	// Underflow (including f24 values with zero exponent and mantissa)
+	i = (i & 0x7FFFFFFF) <= 0x20000000 ? sign : i;
+	// Overflow saturates to infinity, the highest f24 exponent means infinity/NaN
+	i = exponent >= 0xBF ? ((exponent > 0xBF ? sign : (i & 0x807FFFFF)) | 0x7F800000) : i;
+
+	memcpy(&f, &i, sizeof(f));
+	return f;
+}
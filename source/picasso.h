@@ -4,7 +4,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <math.h>
 #include <getopt.h>
+#include <sys/time.h>
 #ifdef WIN32
 #include <fcntl.h>
 #endif
@@ -13,10 +15,12 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <algorithm>
 
 #include "FileClass.h"
+#include "f24.h"
 
 #include "maestro_opcodes.h"
 
@@ -24,6 +28,12 @@
 #define stricmp strcasecmp
 #endif
 
+#define safe_call(x) do \
+	{ \
+		int _ = (x); \
+		if (_ != 0) return _; \
+	} while(0)
+
 enum
 {
 	COMP_X = 0,
@@ -63,10 +73,22 @@ enum
 
 // Output buffer
 #define MAX_VSH_SIZE 512
+#define MAX_GSH_SIZE 4096
 typedef std::vector<u32> outputBufType;
 typedef outputBufType::iterator outputBufIter;
 extern outputBufType g_outputBuf;
 
+// Source location of each instruction in the output buffer
+struct SourceLoc
+{
+	int file; // Index in g_sourceFiles
+	int line;
+};
+
+typedef std::vector<SourceLoc> sourceLocTableType;
+extern std::vector<std::string> g_sourceFiles;
+extern sourceLocTableType g_sourceLocTable;
+
 enum
 {
 	SE_PROC,
@@ -96,6 +118,9 @@ extern int g_stackPos;
 extern int g_opdescTable[MAX_OPDESC];
 extern int g_opdeskMasks[MAX_OPDESC]; // used to keep track of used bits
 extern int g_opdescCount;
+extern u32 g_opdescIsMad;
+
+int AllocOpdesc(int opcode, int& out, int opdesc, int mask);
 
 enum
 {
@@ -109,18 +134,23 @@ struct Uniform
 	std::string name;
 	int pos, size;
 	int type;
+	int comp, compCount; // Components used within the register (packed uniforms)
+	int uclass;          // Update class (index in g_updateClasses), or -1
 
 	inline bool operator <(const Uniform& rhs) const
 	{
 		return pos < rhs.pos;
 	}
 
-	void init(const char* name, int pos, int size, int type)
+	void init(const char* name, int pos, int size, int type, int comp = 0, int compCount = 4)
 	{
 		this->name = name;
 		this->pos = pos;
 		this->size = size;
 		this->type = type;
+		this->comp = comp;
+		this->compCount = compCount;
+		this->uclass = -1;
 	}
 };
 
@@ -129,6 +159,15 @@ struct Uniform
 extern Uniform g_uniformTable[MAX_UNIFORM];
 extern int g_uniformCount;
 
+// Uniform update classes, each one placed in a contiguous register range
+struct UpdateClass
+{
+	std::string name;
+	int start[3], count[3]; // Register range for each uniform type (UTYPE_*)
+};
+
+extern std::vector<UpdateClass> g_updateClasses;
+
 struct DVLEData; // Forward declaration
 
 typedef std::pair<size_t, size_t> procedure; // position, size
@@ -157,9 +196,25 @@ extern relocTableType g_labelRelocTable;
 extern aliasTableType g_aliases;
 
 extern bool g_autoNop;
+extern int g_optLevel;
+extern bool g_optReport;
+extern double g_fixupTime; // Seconds spent resolving label relocations, for --timings
 
 int AssembleString(char* str, const char* initialFilename);
 int RelocateProduct(void);
+int OptimizeProduct(void);
+int AllocLinkConstant(const std::vector<DVLEData*>& dvles);
+void CostReport(FILE* f);
+
+static inline double GetWallTime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+const int* GetLatencyTable(void);
+int LoadLatencyTable(const char* filename);
 
 //-----------------------------------------------------------------------------
 // Local data
@@ -189,6 +244,7 @@ struct Constant
 {
 	int regId;
 	int type;
+	bool fixed; // Not a default the application can overwrite (.setf, .seti)
 	union
 	{
 		float fparam[4];
@@ -197,6 +253,13 @@ struct Constant
 	};
 };
 
+// Copy of a DVLE with some bool/int uniforms fixed to a constant value
+struct DVLEVariant
+{
+	std::string name;
+	std::vector<Constant> constants;
+};
+
 struct DVLEData
 {
 	// General config
@@ -219,6 +282,12 @@ struct DVLEData
 	#define MAX_CONSTANT 0x60
 	Constant constantTable[MAX_CONSTANT];
 	int constantCount;
+	int fvecStart, fvecEnd; // Free float uniform space once the file is assembled
+
+	// Variants
+	std::vector<DVLEVariant> variants;
+	std::string variantName; // Set in the DVLEs generated from .variant
+	u16 fixedBools;          // Bool uniforms the code may be specialized on
 
 	// Outputs
 	#define MAX_OUTPUT 16
@@ -252,5 +321,66 @@ struct DVLEData
 		filename(filename), entrypoint("main"),
 		nodvle(false), isGeoShader(false), isCompatGeoShader(false), isMerge(false),
 		inputMask(0), outputMask(0), geoShaderType(0), geoShaderFixedStart(0), geoShaderVariableNum(0), geoShaderFixedNum(0),
-		uniformCount(0), symbolSize(0), constantCount(0), outputUsedReg(0), outputCount(0) { }
+		uniformCount(0), symbolSize(0), constantCount(0), fvecStart(0x20), fvecEnd(0x80), fixedBools(0), outputUsedReg(0), outputCount(0) { }
 };
+
+//-----------------------------------------------------------------------------
+// Link-time optimizer
+//-----------------------------------------------------------------------------
+
+enum
+{
+	IR_INSN = 0, // Regular instruction
+	IR_CALL,     // CALL/CALLC/CALLU to a procedure
+	IR_JUMP,     // JMPC/JMPU to a label
+	IR_LABEL,    // Jump target
+	IR_IF,       // IFC/IFU block
+	IR_FOR,      // FOR block
+};
+
+struct IrInsn
+{
+	int opcode;     // MAESTRO_* opcode (always the non-inverted form)
+	int dest, mask; // Destination register and write mask (bit 3 = x)
+	int src[3];     // Source registers
+	int srcSw[3];   // Source operand descriptors (OPSRC format)
+	int idx[3];     // Relative addressing mode of each source
+	int cmpx, cmpy; // Conditional operators (CMP only)
+};
+
+struct IrNode;
+typedef std::vector<IrNode> IrList;
+typedef IrList::iterator IrListIter;
+
+struct IrNode
+{
+	int type;
+	u32 word;           // Instruction word without operand/target fields
+	IrInsn insn;        // Decoded operands (IR_INSN with operands only)
+	IrInsn decoded;     // Operands as assembled, so unchanged instructions keep their encoding
+	std::string target; // Called procedure (IR_CALL)
+	int label;          // Label id (IR_JUMP and IR_LABEL)
+	IrList body;        // Block body (IR_IF and IR_FOR)
+	IrList elseBody;    // ELSE section (IR_IF)
+	SourceLoc loc;      // Where the instruction comes from
+
+	int opcode() const { return word >> 26; }
+	bool hasOperands() const { return type == IR_INSN && (opcode() < 0x20 || opcode() >= MAESTRO_CMP); }
+	bool isOp(int op) const { return type == IR_INSN && insn.opcode == op; }
+};
+
+struct IrProc
+{
+	std::string name;
+	IrList body;
+	size_t order;            // Position in the original layout
+	size_t pos, size;        // Position after emission
+	std::string fallthrough; // Procedure placed right after this one
+	bool isEntry;
+	std::vector<int> dvles;  // DVLEs reaching the procedure
+
+	IrProc() : order(0), pos(0), size(0), isEntry(false) { }
+};
+
+typedef std::map<std::string, IrProc> irProcTableType;
+typedef irProcTableType::iterator irProcTableIter;
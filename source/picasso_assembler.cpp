@@ -10,6 +10,9 @@ static bool lastWasEnd = false;
 
 std::vector<u32> g_outputBuf;
 
+std::vector<std::string> g_sourceFiles;
+sourceLocTableType g_sourceLocTable;
+
 StackEntry g_stack[MAX_STACK];
 int g_stackPos;
 
@@ -26,6 +29,9 @@ int g_constArraySize = -1;
 const char* g_constArrayName;
 
 bool g_autoNop = true;
+int g_optLevel = 0;
+bool g_optReport = false;
+double g_fixupTime = 0;
 
 class UniformAlloc
 {
@@ -35,6 +41,7 @@ public:
 	void ClearLocal(void) { end = tend; }
 	void Reinit(int start, int end)
 	{
+		packed.clear();
 		this->start = start;
 		this->end = end;
 		this->bound = end;
@@ -55,6 +62,30 @@ public:
 		end = pos;
 		return pos;
 	}
+	int GetStart(void) const { return start; }
+	int GetEnd(void) const { return end; }
+
+	// Registers shared by small uniforms of the same update class
+	struct PackedReg { int pos, used, group; };
+	std::vector<PackedReg> packed;
+	int AllocPacked(int count, int group, int& comp)
+	{
+		int want = (1 << count) - 1;
+		for (size_t i = 0; i < packed.size(); i ++)
+			for (int c = 0; packed[i].group == group && c + count <= 4; c ++)
+				if (!(packed[i].used & (want << c)))
+				{
+					packed[i].used |= want << c;
+					comp = c;
+					return packed[i].pos;
+				}
+		int pos = AllocGlobal(1);
+		if (pos < 0) return -1;
+		PackedReg r = { pos, want, group };
+		packed.push_back(r);
+		comp = 0;
+		return pos;
+	}
 };
 
 struct UniformAllocBundle
@@ -104,12 +135,25 @@ aliasTableType g_aliases;
 
 static DVLEData* curDvle;
 
+// Constant registers of the current file which can be shared by several
+// constants when optimizing: index in the constant table and mask of the
+// components in use (bit 0 = x)
+static std::vector<std::pair<int, int> > g_constPacking;
+static std::set<std::string> g_packedConsts;
+
+// Update class of the uniforms being declared
+static int curUpdateClass;
+std::vector<UpdateClass> g_updateClasses;
+
 static void ClearStatus(void)
 {
+	curUpdateClass = -1;
 	unifAlloc[0].clear();
 	g_labels.clear();
 	g_labelRelocTable.clear();
 	g_aliases.clear();
+	g_constPacking.clear();
+	g_packedConsts.clear();
 	curDvle = NULL;
 }
 
@@ -208,15 +252,56 @@ static int parseInt(char* pos, int& out, long long min, long long max)
 	return 0;
 }
 
-#define safe_call(x) do \
-	{ \
-		int _ = (x); \
-		if (_ != 0) return _; \
-	} while(0)
-
 static int ProcessCommand(const char* cmd);
 static int FixupLabelRelocations();
 
+static void RecordSourceLoc(void)
+{
+	SourceLoc loc;
+	loc.file = std::find(g_sourceFiles.begin(), g_sourceFiles.end(), curFile) - g_sourceFiles.begin();
+	loc.line = curLine;
+	if (loc.file == (int)g_sourceFiles.size())
+		g_sourceFiles.push_back(curFile);
+	g_sourceLocTable.resize(BUF.size(), loc);
+}
+
+// Each variant becomes a DVLE of its own, placed right after the original one
+static int AddVariants(DVLEData* dvle)
+{
+	if (dvle->variants.empty())
+		return 0;
+	if (dvle->nodvle)
+		return throwError(".variant cannot be used together with .nodvle\n");
+
+	std::vector<DVLEVariant> variants;
+	variants.swap(dvle->variants);
+	for (size_t i = 0; i < variants.size(); i ++)
+	{
+		const DVLEVariant& v = variants[i];
+		g_dvleTable.push_back(*dvle);
+		g_totalDvleCount ++;
+
+		DVLEData& d = g_dvleTable.back();
+		d.variantName = v.name;
+		for (size_t j = 0; j < v.constants.size(); j ++)
+		{
+			const Constant& ct = v.constants[j];
+			int k;
+			for (k = 0; k < d.constantCount && d.constantTable[k].regId != ct.regId; k ++);
+			if (k == d.constantCount)
+			{
+				if (k == MAX_CONSTANT)
+					return throwError("too many local constants in variant '%s'\n", v.name.c_str());
+				d.constantCount ++;
+			}
+			d.constantTable[k] = ct;
+			if (ct.type == UTYPE_BOOL)
+				d.fixedBools |= BIT(ct.regId-0x88);
+		}
+	}
+	return 0;
+}
+
 int AssembleString(char* str, const char* initialFilename)
 {
 	curFile = initialFilename;
@@ -278,12 +363,27 @@ int AssembleString(char* str, const char* initialFilename)
 
 		char* tok = mystrtok_spc(line);
 		safe_call(ProcessCommand(tok));
+		if (g_sourceLocTable.size() < BUF.size())
+			RecordSourceLoc();
 	}
 
 	if (g_stackPos)
 		return throwError("unclosed block(s)\n");
 
+	double fixupStart = GetWallTime();
 	safe_call(FixupLabelRelocations());
+	g_fixupTime += GetWallTime() - fixupStart;
+
+	// Keep track of the free uniform space in case the linker needs to add constants
+	if (curDvle)
+	{
+		UniformAlloc& alloc = getAlloc(UTYPE_FVEC, curDvle);
+		curDvle->fvecStart = alloc.GetStart();
+		curDvle->fvecEnd = alloc.GetEnd();
+	}
+
+	if (curDvle)
+		safe_call(AddVariants(curDvle));
 	
 	return 0;
 }
@@ -304,8 +404,111 @@ int FixupLabelRelocations()
 	return 0;
 }
 
+// Moves the register field of an instruction holding a uniform
+static u32 RemapUniformField(u32 w, int shift, int bits, int base, const int* map)
+{
+	int reg = ((w >> shift) & ((1 << bits) - 1)) + base;
+	w &= ~(((1 << bits) - 1) << shift);
+	return w | ((map[reg] - base) << shift);
+}
+
+static void RemapUniforms(const int* map)
+{
+	for (outputBufIter it = BUF.begin(); it != BUF.end(); ++it)
+	{
+		u32& w = *it;
+		int op = w >> 26;
+		if (op >= MAESTRO_MADI)
+			w = RemapUniformField(w, op < MAESTRO_MAD ? 5 : 10, 7, 0, map);
+		else if ((op &~ 1) == MAESTRO_CMP)
+			w = RemapUniformField(w, 12, 7, 0, map);
+		else if (op >= MAESTRO_DPHI && op <= MAESTRO_SLTI)
+			w = RemapUniformField(w, 7, 7, 0, map);
+		else if (op < 0x20)
+			w = RemapUniformField(w, 12, 7, 0, map);
+		else if (op == MAESTRO_FOR)
+			w = RemapUniformField(w, 22, 2, 0x80, map);
+		else if (op == MAESTRO_IFU || op == MAESTRO_CALLU || op == MAESTRO_JMPU)
+			w = RemapUniformField(w, 22, 4, 0x88, map);
+	}
+
+	for (int i = 0; i < g_uniformCount; i ++)
+		g_uniformTable[i].pos = map[g_uniformTable[i].pos];
+
+	for (dvleTableIter it = g_dvleTable.begin(); it != g_dvleTable.end(); ++it)
+	{
+		for (int i = 0; i < it->uniformCount; i ++)
+			if (it->uniformTable[i].pos >= 0x20)
+				it->uniformTable[i].pos = map[it->uniformTable[i].pos];
+		for (int i = 0; i < it->constantCount; i ++)
+			it->constantTable[i].regId = map[it->constantTable[i].regId];
+
+		u16 fixedBools = 0;
+		for (int i = 0; i < 16; i ++)
+			if (it->fixedBools & BIT(i))
+				fixedBools |= BIT(map[0x88+i]-0x88);
+		it->fixedBools = fixedBools;
+	}
+}
+
+// Uniforms of each update class are moved next to each other, after the
+// uniforms without an update class, keeping their relative order
+static int LayoutUpdateClasses(void)
+{
+	if (g_updateClasses.empty())
+		return 0;
+
+	for (dvleTableIter it = g_dvleTable.begin(); it != g_dvleTable.end(); ++it)
+		if (it->usesGshSpace())
+			return throwError("update classes cannot be used together with geometry shader uniform space\n");
+
+	int map[0x98];
+	for (int i = 0; i < 0x98; i ++)
+		map[i] = i;
+
+	static const int bases[3] = { 0x88, 0x80, 0x20 }; // UTYPE_BOOL, UTYPE_IVEC, UTYPE_FVEC
+	for (int type = 0; type < 3; type ++)
+	{
+		// (class, old position) of each register range
+		std::vector<std::pair<int, int> > units;
+		std::map<int, int> sizes;
+		for (int i = 0; i < g_uniformCount; i ++)
+		{
+			Uniform& u = g_uniformTable[i];
+			if (u.type != type || sizes.count(u.pos))
+				continue;
+			sizes[u.pos] = u.size;
+			units.push_back(std::make_pair(u.uclass, u.pos));
+		}
+		std::sort(units.begin(), units.end());
+
+		int pos = bases[type];
+		for (size_t i = 0; i < units.size(); i ++)
+		{
+			int uclass = units[i].first, size = sizes[units[i].second];
+			if (uclass >= 0)
+			{
+				UpdateClass& uc = g_updateClasses[uclass];
+				if (!uc.count[type])
+					uc.start[type] = pos - bases[type];
+				uc.count[type] += size;
+			}
+			for (int j = 0; j < size; j ++)
+				map[units[i].second + j] = pos ++;
+		}
+	}
+
+	RemapUniforms(map);
+	return 0;
+}
+
 int RelocateProduct()
 {
+	safe_call(LayoutUpdateClasses());
+
+	if (g_optLevel > 0)
+		safe_call(OptimizeProduct());
+
 	for (relocTableIter it = g_procRelocTable.begin(); it != g_procRelocTable.end(); ++it)
 	{
 		relocation& r = *it;
@@ -336,6 +539,28 @@ int RelocateProduct()
 	return 0;
 }
 
+// Allocates a float constant register which is free in all the given DVLEs.
+// Vertex shader uniforms are shared, so their final extent is used.
+int AllocLinkConstant(const std::vector<DVLEData*>& dvles)
+{
+	int end = 0x80;
+	for (size_t i = 0; i < dvles.size(); i ++)
+		end = dvles[i]->fvecEnd < end ? dvles[i]->fvecEnd : end;
+
+	for (size_t i = 0; i < dvles.size(); i ++)
+	{
+		DVLEData* dvle = dvles[i];
+		int start = dvle->usesGshSpace() ? dvle->fvecStart : unifAlloc[0].fvecAlloc.GetStart();
+		UniformAlloc alloc(start, dvle->fvecEnd);
+		if (alloc.AllocLocal(dvle->fvecEnd - end + 1) < 0)
+			return -1;
+	}
+
+	for (size_t i = 0; i < dvles.size(); i ++)
+		dvles[i]->fvecEnd = end - 1;
+	return end - 1;
+}
+
 // --------------------------------------------------------------------
 // Commands
 // --------------------------------------------------------------------
@@ -635,6 +860,30 @@ static int findOrAddOpdesc(int opcode, int& out, int opdesc, int mask)
 	return 0;
 }
 
+static void swapOpdesc(u32 from, u32 to);
+
+int AllocOpdesc(int opcode, int& out, int opdesc, int mask)
+{
+	safe_call(findOrAddOpdesc(opcode, out, opdesc, mask));
+	if (opcode != MAESTRO_MAD)
+		return 0;
+
+	if (out >= 32)
+	{
+		int which;
+		for (which = 0; which < 32; which ++)
+			if (!(g_opdescIsMad & BIT(which)))
+				break;
+		if (which == 32)
+			return throwError("opdesc allocation error\n");
+		swapOpdesc(which, out);
+		out = which;
+	}
+
+	g_opdescIsMad |= BIT(out);
+	return 0;
+}
+
 static void swapOpdesc(u32 from, u32 to)
 {
 	std::swap(g_opdescTable[from], g_opdescTable[to]);
@@ -739,6 +988,9 @@ static int parseReg(char* pos, int& outReg, int& outSw, int* idxType = NULL)
 	aliasTableIter it = g_aliases.find(pos);
 	if (it != g_aliases.end())
 	{
+		if ((regOffset || (idxType && *idxType)) && g_packedConsts.count(pos))
+			return throwError("constant '%s' cannot be indexed when constants are packed (use .constfa instead)\n", pos);
+
 		int x = it->second;
 		outReg = x & 0xFF;
 		outReg += regOffset;
@@ -987,21 +1239,7 @@ DEF_COMMAND(format5)
 		return throwError("source registers must be different input registers (v0..v15)\n");
 
 	int opdesc = 0;
-	safe_call(findOrAddOpdesc(opcode, opdesc, OPDESC_MAKE(maskFromSwizzling(rDestSw), rSrc1Sw, rSrc2Sw, rSrc3Sw), OPDESC_MASK_D123));
-
-	if (opdesc >= 32)
-	{
-		int which;
-		for (which = 0; which < 32; which ++)
-			if (!(g_opdescIsMad & BIT(which)))
-				break;
-		if (which == 32)
-			return throwError("opdesc allocation error\n");
-		swapOpdesc(which, opdesc);
-		opdesc = which;
-	}
-
-	g_opdescIsMad |= BIT(opdesc);
+	safe_call(AllocOpdesc(opcode, opdesc, OPDESC_MAKE(maskFromSwizzling(rDestSw), rSrc1Sw, rSrc2Sw, rSrc3Sw), OPDESC_MASK_D123));
 
 #ifdef DEBUG
 	printf("%s:%02X d%02X, d%02X, d%02X, d%02X (0x%X)\n", cmdName, opcode, rDest, rSrc1, rSrc2, rSrc3, opdesc);
@@ -1450,6 +1688,7 @@ DEF_DIRECTIVE(end)
 				Constant c;
 				memset(&c, 0, sizeof(c));
 				c.type = UTYPE_FVEC;
+				c.fixed = true;
 				g_constArray.push_back(c);
 			}
 
@@ -1469,6 +1708,8 @@ DEF_DIRECTIVE(end)
 				Constant& dst = dvle->constantTable[dvle->constantCount++];
 				src.regId = uniformPos+i;
 				memcpy(&dst, &src, sizeof(src));
+				if (g_optLevel > 0)
+					g_constPacking.push_back(std::make_pair(dvle->constantCount-1, 0xF));
 			}
 
 			g_aliases.insert( std::pair<std::string,int>(g_constArrayName, uniformPos | (DEFAULT_OPSRC<<8)) );
@@ -1527,6 +1768,20 @@ DEF_DIRECTIVE(uniform)
 			if (uSize < 1)
 				return throwError("invalid uniform size: %s[%s]\n", argText, sizePos);
 		}
+
+		// Small uniforms may be packed together: name.x, name.xy or name.xyz
+		int compCount = 4, comp = 0;
+		char* compPos = strchr(argText, '.');
+		if (compPos)
+		{
+			*compPos++ = 0;
+			compCount = strlen(compPos);
+			if (dirParam != UTYPE_FVEC || sizePos)
+				return throwError("only single floating-point vector uniforms can be packed: %s\n", argText);
+			if (compCount < 1 || compCount > 3 || strncmp(compPos, "xyz", compCount) != 0)
+				return throwError("invalid component hint (expected x, xy or xyz): %s\n", compPos);
+		}
+
 		if (!validateIdentifier(argText))
 			return throwError("invalid uniform name: %s\n", argText);
 		if (g_aliases.find(argText) != g_aliases.end())
@@ -1545,7 +1800,12 @@ DEF_DIRECTIVE(uniform)
 					return throwError("mismatched uniform type: %s\n", argText);
 				if (uniform.size != uSize)
 					return throwError("uniform '%s' previously declared as having size %d\n", argText, uniform.size);
+				if (uniform.compCount != compCount)
+					return throwError("uniform '%s' previously declared as having %d components\n", argText, uniform.compCount);
+				if (curUpdateClass >= 0 && uniform.uclass != curUpdateClass)
+					return throwError("uniform '%s' previously declared with a different update class\n", argText);
 				uniformPos = uniform.pos;
+				comp = uniform.comp;
 				break;
 			}
 		}
@@ -1556,24 +1816,33 @@ DEF_DIRECTIVE(uniform)
 			if (g_uniformCount == MAX_UNIFORM)
 				return throwError("too many global uniforms: %s\n", argText);
 
-			uniformPos = alloc.AllocGlobal(uSize);
+			uniformPos = compCount < 4 ? alloc.AllocPacked(compCount, curUpdateClass, comp) : alloc.AllocGlobal(uSize);
 			if (uniformPos < 0)
 				return throwError("not enough uniform space: %s[%d]\n", argText, uSize);
 		}
 
 		if (useSharedSpace)
-			g_uniformTable[g_uniformCount++].init(argText, uniformPos, uSize, dirParam);
+		{
+			int uclass = i < g_uniformCount ? g_uniformTable[i].uclass : curUpdateClass;
+			g_uniformTable[g_uniformCount++].init(argText, uniformPos, uSize, dirParam, comp, compCount);
+			g_uniformTable[g_uniformCount-1].uclass = uclass;
+		} else if (curUpdateClass >= 0)
+			return throwError("update classes cannot be used in geometry shader uniform space: %s\n", argText);
 
 		if (*argText != '_')
 		{
 			// Add the uniform to the table
 			if (dvle->uniformCount == MAX_UNIFORM)
 				return throwError("too many referenced uniforms: %s\n", argText);
-			dvle->uniformTable[dvle->uniformCount++].init(argText, uniformPos, uSize, dirParam);
+			dvle->uniformTable[dvle->uniformCount++].init(argText, uniformPos, uSize, dirParam, comp, compCount);
 			dvle->symbolSize += strlen(argText)+1;
 		}
 
-		g_aliases.insert( std::pair<std::string,int>(argText, uniformPos | (DEFAULT_OPSRC<<8)) );
+		// Components past the last one of a packed uniform repeat it
+		int sw = 0;
+		for (int j = 0; j < 4; j ++)
+			sw |= SWIZZLE_COMP(j, comp + (j < compCount ? j : compCount-1));
+		g_aliases.insert( std::pair<std::string,int>(argText, uniformPos | (OPSRC_MAKE(0, sw)<<8)) );
 
 #ifdef DEBUG
 		printf("uniform %s[%d] @ d%02X:d%02X\n", argText, uSize, uniformPos, uniformPos+uSize-1);
@@ -1582,6 +1851,55 @@ DEF_DIRECTIVE(uniform)
 	return 0;
 }
 
+// Places the values in the components of a constant register, reusing the
+// components holding equal values and, if allowed to grow, taking free ones
+static bool packConst(Constant& ct, int& used, const float* v, bool grow, int& sw)
+{
+	float vals[4];
+	memcpy(vals, ct.fparam, sizeof(vals));
+	int newUsed = used;
+	int newSw = 0;
+	for (int c = 0; c < 4; c ++)
+	{
+		int k;
+		for (k = 0; k < 4 && !((newUsed & BIT(k)) && f32tof24(vals[k]) == f32tof24(v[c])); k ++);
+		if (k == 4)
+		{
+			for (k = 0; grow && k < 4 && (newUsed & BIT(k)); k ++);
+			if (!grow || k == 4)
+				return false;
+			vals[k] = v[c];
+			newUsed |= BIT(k);
+		}
+		newSw |= SWIZZLE_COMP(c, k);
+	}
+
+	memcpy(ct.fparam, vals, sizeof(vals));
+	used = newUsed;
+	sw = newSw;
+	return true;
+}
+
+// Finds a constant register of the current file which already holds the
+// value, or else has room for it
+static int findPackedConst(DVLEData* dvle, const Constant& value, int& sw)
+{
+	for (int grow = 0; grow < 2; grow ++)
+		for (size_t i = 0; i < g_constPacking.size(); i ++)
+		{
+			Constant& ct = dvle->constantTable[g_constPacking[i].first];
+			if (ct.type != value.type)
+				continue;
+			if (ct.type == UTYPE_IVEC)
+			{
+				if (!grow && memcmp(ct.iparam, value.iparam, sizeof(ct.iparam)) == 0)
+					return ct.regId;
+			} else if (packConst(ct, g_constPacking[i].second, value.fparam, grow != 0, sw))
+				return ct.regId;
+		}
+	return -1;
+}
+
 DEF_DIRECTIVE(const)
 {
 	DVLEData* dvle = GetDvleData();
@@ -1601,37 +1919,62 @@ DEF_DIRECTIVE(const)
 	if (g_aliases.find(constName) != g_aliases.end())
 		return duplicateIdentifier(constName);
 
-	int uniformPos = alloc.AllocLocal(1);
-	if (uniformPos < 0)
-		return throwError("not enough space for local constant '%s'\n", constName);
-
-	if (dvle->constantCount == MAX_CONSTANT)
-		return throwError("too many local constants\n");
-
-	Constant& ct = dvle->constantTable[dvle->constantCount++];
-	ct.regId = uniformPos;
-	ct.type = dirParam;
+	Constant value;
+	memset(&value, 0, sizeof(value));
+	value.type = dirParam;
 	if (dirParam == UTYPE_FVEC)
 	{
-		ct.fparam[0] = atof(arg0Text);
-		ct.fparam[1] = atof(arg1Text);
-		ct.fparam[2] = atof(arg2Text);
-		ct.fparam[3] = atof(arg3Text);
+		value.fparam[0] = atof(arg0Text);
+		value.fparam[1] = atof(arg1Text);
+		value.fparam[2] = atof(arg2Text);
+		value.fparam[3] = atof(arg3Text);
 	} else if (dirParam == UTYPE_IVEC)
 	{
-		ct.iparam[0] = atoi(arg0Text) & 0xFF;
-		ct.iparam[1] = atoi(arg1Text) & 0xFF;
-		ct.iparam[2] = atoi(arg2Text) & 0xFF;
-		ct.iparam[3] = atoi(arg3Text) & 0xFF;
+		value.iparam[0] = atoi(arg0Text) & 0xFF;
+		value.iparam[1] = atoi(arg1Text) & 0xFF;
+		value.iparam[2] = atoi(arg2Text) & 0xFF;
+		value.iparam[3] = atoi(arg3Text) & 0xFF;
+	}
+
+	int sw = DEFAULT_SWIZZLE;
+	int reg = g_optLevel > 0 ? findPackedConst(dvle, value, sw) : -1;
+	if (reg < 0)
+	{
+		int uniformPos = alloc.AllocLocal(1);
+		if (uniformPos < 0)
+			return throwError("not enough space for local constant '%s'\n", constName);
+
+		if (dvle->constantCount == MAX_CONSTANT)
+			return throwError("too many local constants\n");
+
+		int index = dvle->constantCount++;
+		Constant& ct = dvle->constantTable[index];
+		ct.regId = reg = uniformPos;
+		ct.type = dirParam;
+		ct.fixed = true;
+		if (g_optLevel > 0)
+		{
+			// Only the distinct values take up components
+			int used = 0;
+			memset(ct.fparam, 0, sizeof(ct.fparam));
+			if (dirParam == UTYPE_FVEC)
+				packConst(ct, used, value.fparam, true, sw);
+			else
+				memcpy(ct.iparam, value.iparam, sizeof(ct.iparam));
+			g_constPacking.push_back(std::make_pair(index, used));
+		} else
+			memcpy(ct.fparam, value.fparam, sizeof(ct.fparam));
 	}
 
-	g_aliases.insert( std::pair<std::string,int>(constName, ct.regId | (DEFAULT_OPSRC<<8)) );
+	if (g_optLevel > 0)
+		g_packedConsts.insert(constName);
+	g_aliases.insert( std::pair<std::string,int>(constName, reg | (OPSRC_MAKE(0, sw)<<8)) );
 
 #ifdef DEBUG
 	if (dirParam == UTYPE_FVEC)
-		printf("constant %s(%f, %f, %f, %f) @ d%02X\n", constName, ct.fparam[0], ct.fparam[1], ct.fparam[2], ct.fparam[3], ct.regId);
+		printf("constant %s(%f, %f, %f, %f) @ d%02X\n", constName, value.fparam[0], value.fparam[1], value.fparam[2], value.fparam[3], reg);
 	else if (dirParam == UTYPE_IVEC)
-		printf("constant %s(%u, %u, %u, %u) @ d%02X\n", constName, ct.iparam[0], ct.iparam[1], ct.iparam[2], ct.iparam[3], ct.regId);
+		printf("constant %s(%u, %u, %u, %u) @ d%02X\n", constName, value.iparam[0], value.iparam[1], value.iparam[2], value.iparam[3], reg);
 #endif
 	return 0;
 };
@@ -1700,6 +2043,7 @@ DEF_DIRECTIVE(constfa)
 
 		Constant ct;
 		ct.type = UTYPE_FVEC;
+		ct.fixed = true;
 		ct.fparam[0] = atof(arg0Text);
 		ct.fparam[1] = atof(arg1Text);
 		ct.fparam[2] = atof(arg2Text);
@@ -1742,6 +2086,7 @@ DEF_DIRECTIVE(setfi)
 	Constant& ct = dvle->constantTable[dvle->constantCount++];
 	ct.regId = constReg;
 	ct.type = dirParam;
+	ct.fixed = false;
 	if (dirParam == UTYPE_FVEC)
 	{
 		ct.fparam[0] = atof(arg0Text);
@@ -1792,6 +2137,7 @@ DEF_DIRECTIVE(setb)
 	Constant& ct = dvle->constantTable[dvle->constantCount++];
 	ct.regId = constReg;
 	ct.type = UTYPE_BOOL;
+	ct.fixed = false;
 	ct.bparam = constVal;
 
 	return 0;
@@ -1953,6 +2299,151 @@ DEF_DIRECTIVE(nodvle)
 	return 0;
 }
 
+static int parseVariantValue(Constant& ct, char* regText, const char* valueText)
+{
+	ARG_TO_REG(reg, regText);
+	ct.regId = reg;
+	ct.fixed = true;
+	if (reg >= 0x88 && reg < 0x98)
+	{
+		bool value = false;
+		safe_call(parseBool(value, valueText));
+		ct.type = UTYPE_BOOL;
+		ct.bparam = value;
+	} else if (reg >= 0x80 && reg < 0x84)
+	{
+		int x, y, z, w;
+		if (sscanf(valueText, "(%d,%d,%d,%d)", &x, &y, &z, &w) != 4)
+			return throwError("invalid integer vector: %s\n", valueText);
+		ct.type = UTYPE_IVEC;
+		ct.iparam[0] = x & 0xFF;
+		ct.iparam[1] = y & 0xFF;
+		ct.iparam[2] = z & 0xFF;
+		ct.iparam[3] = w & 0xFF;
+	} else
+		return throwError("invalid bool or integer vector uniform: %s\n", regText);
+	return 0;
+}
+
+static int addVariant(DVLEData* dvle, const DVLEVariant& v)
+{
+	for (size_t i = 0; i < dvle->variants.size(); i ++)
+		if (dvle->variants[i].name == v.name)
+			return duplicateIdentifier(v.name.c_str());
+	dvle->variants.push_back(v);
+	return 0;
+}
+
+DEF_DIRECTIVE(variant)
+{
+	DVLEData* dvle = GetDvleData();
+
+	NEXT_ARG_SPC(name);
+	if (!validateIdentifier(name))
+		return throwError("invalid identifier: %s\n", name);
+
+	DVLEVariant v;
+	v.name = name;
+	for (char* arg; (arg = nextArgSpc()); )
+	{
+		char* valueText = strchr(arg, '=');
+		if (!valueText)
+			return throwError("invalid syntax: %s\n", arg);
+		*valueText++ = 0;
+
+		Constant ct;
+		safe_call(parseVariantValue(ct, arg, valueText));
+		v.constants.push_back(ct);
+	}
+
+	if (v.constants.empty())
+		return missingParam();
+
+	return addVariant(dvle, v);
+}
+
+#define MAX_PERMUTATIONS 64
+
+DEF_DIRECTIVE(permute)
+{
+	DVLEData* dvle = GetDvleData();
+
+	NEXT_ARG_SPC(prefix);
+	if (!validateIdentifier(prefix))
+		return throwError("invalid identifier: %s\n", prefix);
+
+	// One list of possible values for each register
+	std::vector<std::vector<Constant> > matrix;
+	size_t total = 1;
+	for (char* arg; (arg = nextArgSpc()); )
+	{
+		char* valueText = strchr(arg, '=');
+		if (!valueText)
+			return throwError("invalid syntax: %s\n", arg);
+		*valueText++ = 0;
+
+		std::vector<Constant> values;
+		for (char* next; valueText; valueText = next)
+		{
+			next = strchr(valueText, '|');
+			if (next)
+				*next++ = 0;
+			Constant ct;
+			safe_call(parseVariantValue(ct, arg, valueText));
+			values.push_back(ct);
+		}
+
+		total *= values.size();
+		if (total > MAX_PERMUTATIONS)
+			return throwError("too many permutations (max %d)\n", MAX_PERMUTATIONS);
+		matrix.push_back(values);
+	}
+
+	if (matrix.empty())
+		return missingParam();
+
+	// The last register varies fastest
+	for (size_t i = 0; i < total; i ++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "%u", (unsigned)i);
+
+		DVLEVariant v;
+		v.name = std::string(prefix) + name;
+		for (size_t j = matrix.size(), k = i; j --; k /= matrix[j].size())
+			v.constants.insert(v.constants.begin(), matrix[j][k % matrix[j].size()]);
+		safe_call(addVariant(dvle, v));
+	}
+
+	return 0;
+}
+
+DEF_DIRECTIVE(update)
+{
+	char* className = nextArgSpc();
+	ENSURE_NO_MORE_ARGS();
+
+	if (!className)
+	{
+		curUpdateClass = -1;
+		return 0;
+	}
+
+	if (!validateIdentifier(className))
+		return throwError("invalid identifier: %s\n", className);
+
+	for (curUpdateClass = 0; curUpdateClass < (int)g_updateClasses.size(); curUpdateClass ++)
+		if (g_updateClasses[curUpdateClass].name == className)
+			return 0;
+
+	UpdateClass uc;
+	memset(uc.start, 0, sizeof(uc.start));
+	memset(uc.count, 0, sizeof(uc.count));
+	uc.name = className;
+	g_updateClasses.push_back(uc);
+	return 0;
+}
+
 static inline int parseGshType(const char* text)
 {
 	if (stricmp(text,"point")==0)
@@ -2052,6 +2543,9 @@ static const cmdTableType dirTable[] =
 	DEC_DIRECTIVE2(setf, setfi, UTYPE_FVEC),
 	DEC_DIRECTIVE2(seti, setfi, UTYPE_IVEC),
 	DEC_DIRECTIVE(setb),
+	DEC_DIRECTIVE(variant),
+	DEC_DIRECTIVE(permute),
+	DEC_DIRECTIVE(update),
 	{ NULL, NULL },
 };
 
@@ -0,0 +1,377 @@
+#include "picasso.h"
+
+// The cost analyzer walks the final program from the entrypoint of each DVLE
+// and bounds the number of instructions and cycles a single run can take.
+// Loop trip counts and uniform branches are resolved using the constants of
+// the DVLE where possible.
+
+#define BUF g_outputBuf
+#define COST_INF (~(u64)0)
+
+static const int* costLatency;
+
+// Bounds of the instructions ([0]) and cycles ([1]) taken by a set of paths
+struct CostRange
+{
+	bool valid;
+	u64 lo[2], hi[2];
+
+	CostRange() : valid(false) { }
+	CostRange(u64 insns, u64 cycles) : valid(true)
+	{
+		lo[0] = hi[0] = insns;
+		lo[1] = hi[1] = cycles;
+	}
+};
+
+// Paths through a piece of code, by the way they leave it
+struct CostFlow
+{
+	CostRange fall;  // Reaching the end of the code
+	CostRange ended; // Running END
+	CostRange broke; // Breaking out of the enclosing loop
+};
+
+static inline u64 costAdd(u64 a, u64 b)
+{
+	return a == COST_INF || b == COST_INF || a + b < a ? COST_INF : a + b;
+}
+
+static inline u64 costMul(u64 a, u64 n)
+{
+	return a == COST_INF || (n && a > COST_INF / n) ? COST_INF : a * n;
+}
+
+static CostRange operator +(const CostRange& a, const CostRange& b)
+{
+	CostRange r;
+	if (!a.valid || !b.valid)
+		return r;
+	r.valid = true;
+	for (int i = 0; i < 2; i ++)
+	{
+		r.lo[i] = costAdd(a.lo[i], b.lo[i]);
+		r.hi[i] = costAdd(a.hi[i], b.hi[i]);
+	}
+	return r;
+}
+
+static CostRange operator |(const CostRange& a, const CostRange& b)
+{
+	if (!a.valid)
+		return b;
+	if (!b.valid)
+		return a;
+	CostRange r = a;
+	for (int i = 0; i < 2; i ++)
+	{
+		r.lo[i] = std::min(a.lo[i], b.lo[i]);
+		r.hi[i] = std::max(a.hi[i], b.hi[i]);
+	}
+	return r;
+}
+
+// Runs a, then b if a reaches its end
+static CostFlow costSeq(const CostFlow& a, const CostFlow& b)
+{
+	CostFlow r;
+	r.fall = a.fall + b.fall;
+	r.ended = a.ended | (a.fall + b.ended);
+	r.broke = a.broke | (a.fall + b.broke);
+	return r;
+}
+
+static CostFlow costEither(const CostFlow& a, const CostFlow& b)
+{
+	CostFlow r;
+	r.fall = a.fall | b.fall;
+	r.ended = a.ended | b.ended;
+	r.broke = a.broke | b.broke;
+	return r;
+}
+
+static CostFlow costStep(const CostRange& c)
+{
+	CostFlow r;
+	r.fall = c;
+	return r;
+}
+
+// Runs a loop body between lo and hi times, stopping early on BREAK or END
+static CostFlow costLoop(const CostFlow& body, u64 lo, u64 hi)
+{
+	CostFlow r;
+	if (body.fall.valid)
+	{
+		r.fall.valid = true;
+		for (int i = 0; i < 2; i ++)
+		{
+			r.fall.lo[i] = costMul(body.fall.lo[i], lo);
+			r.fall.hi[i] = costMul(body.fall.hi[i], hi);
+		}
+	}
+
+	// Leaving the loop during the last possible iteration is the worst case
+	CostRange before;
+	if (body.fall.valid)
+	{
+		before = body.fall;
+		for (int i = 0; i < 2; i ++)
+		{
+			before.lo[i] = 0;
+			before.hi[i] = costMul(body.fall.hi[i], hi-1);
+		}
+	} else
+		before = CostRange(0, 0);
+
+	r.fall = r.fall | (before + body.broke);
+	r.ended = before + body.ended;
+	return r;
+}
+
+struct CostWalker
+{
+	const DVLEData* dvle;
+	std::map<std::pair<size_t, size_t>, CostFlow> memo;
+	std::map<size_t, size_t> calls; // Called code, start -> size
+	std::vector<bool> reached;
+	int depth;
+	bool unstructured;
+
+	CostWalker(const DVLEData* dvle) : dvle(dvle), reached(BUF.size()), depth(0), unstructured(false) { }
+
+	const Constant* constant(int regId) const
+	{
+		for (int i = 0; dvle && i < dvle->constantCount; i ++)
+			if (dvle->constantTable[i].regId == regId)
+				return &dvle->constantTable[i];
+		return NULL;
+	}
+
+	// Returns 1 or 0 for a constant boolean uniform, -1 otherwise (.setb
+	// defaults can be overwritten by the application)
+	int knownBool(int id) const
+	{
+		const Constant* ct = constant(0x88 + id);
+		return ct && ct->type == UTYPE_BOOL && ct->fixed ? ct->bparam : -1;
+	}
+
+	CostFlow call(size_t start, size_t size);
+	CostFlow walk(size_t pc, size_t end);
+};
+
+CostFlow CostWalker::call(size_t start, size_t size)
+{
+	// Calls nest at most as deep as the hardware stack allows
+	if (depth == 8)
+	{
+		unstructured = true;
+		CostFlow r = costStep(CostRange(0, 0));
+		for (int i = 0; i < 2; i ++)
+			r.fall.hi[i] = COST_INF;
+		return r;
+	}
+
+	calls.insert(std::make_pair(start, size));
+	depth ++;
+	CostFlow r = walk(start, start + size);
+	depth --;
+	return r;
+}
+
+CostFlow CostWalker::walk(size_t pc, size_t end)
+{
+	std::pair<size_t, size_t> key(pc, end);
+	std::map<std::pair<size_t, size_t>, CostFlow>::iterator it = memo.find(key);
+	if (it != memo.end())
+		return it->second;
+
+	CostFlow acc = costStep(CostRange(0, 0));
+	while (pc != end && acc.fall.valid)
+	{
+		if (pc >= BUF.size())
+		{
+			unstructured = true;
+			break;
+		}
+
+		reached[pc] = true;
+		u32 w = BUF[pc];
+		int op = w >> 26;
+		size_t dst = (w>>10) & 0xFFF, num = w & 0x3FF;
+		CostRange c(1, costLatency[op]);
+		CostFlow step = costStep(c);
+
+		switch (op)
+		{
+			case MAESTRO_END:
+				step.fall = CostRange();
+				step.ended = c;
+				break;
+
+			case MAESTRO_BREAK:
+			case MAESTRO_BREAKC:
+				if (op == MAESTRO_BREAK)
+					step.fall = CostRange();
+				step.broke = c;
+				break;
+
+			case MAESTRO_CALL:
+			case MAESTRO_CALLC:
+			case MAESTRO_CALLU:
+			{
+				int known = op == MAESTRO_CALL ? 1 : op == MAESTRO_CALLU ? knownBool((w>>22) & 0xF) : -1;
+				if (known != 0)
+				{
+					CostFlow callee = costSeq(step, call(dst, num));
+					step = known == 1 ? callee : costEither(step, callee);
+				}
+				break;
+			}
+
+			case MAESTRO_IFU:
+			case MAESTRO_IFC:
+			{
+				int known = op == MAESTRO_IFU ? knownBool((w>>22) & 0xF) : -1;
+				CostFlow body;
+				if (known != 0)
+					body = walk(pc+1, dst);
+				if (known != 1)
+					body = known == 0 ? walk(dst, dst+num) : costEither(body, walk(dst, dst+num));
+				acc = costSeq(acc, costSeq(step, body));
+				pc = dst + num;
+				continue;
+			}
+
+			case MAESTRO_FOR:
+			{
+				// The body runs i.x+1 times
+				const Constant* ct = constant(0x80 + ((w>>22) & 3));
+				u64 lo = 1, hi = 256;
+				if (ct && ct->type == UTYPE_IVEC && ct->fixed)
+					lo = hi = ct->iparam[0] + 1;
+				acc = costSeq(acc, costSeq(step, costLoop(walk(pc+1, dst+1), lo, hi)));
+				pc = dst + 1;
+				continue;
+			}
+
+			case MAESTRO_JMPC:
+			case MAESTRO_JMPU:
+			{
+				int known = -1;
+				if (op == MAESTRO_JMPU && (known = knownBool((w>>22) & 0xF)) >= 0)
+					known = known == !(w & 1);
+				if (dst <= pc || dst > end)
+				{
+					// Loops made out of jumps and jumps out of blocks are not followed
+					unstructured = true;
+					break;
+				}
+				if (known == 1)
+				{
+					acc = costSeq(acc, step);
+					pc = dst;
+					continue;
+				}
+				if (known == -1)
+				{
+					acc = costSeq(acc, costSeq(step, costEither(walk(pc+1, end), walk(dst, end))));
+					memo[key] = acc;
+					return acc;
+				}
+				break;
+			}
+		}
+
+		acc = costSeq(acc, step);
+		pc ++;
+	}
+
+	memo[key] = acc;
+	return acc;
+}
+
+static void printRange(FILE* f, const CostRange& r, int i, const char* what)
+{
+	if (r.hi[i] == COST_INF)
+		fprintf(f, "%llu..unbounded %s", (unsigned long long)r.lo[i], what);
+	else
+		fprintf(f, "%llu..%llu %s", (unsigned long long)r.lo[i], (unsigned long long)r.hi[i], what);
+}
+
+static void printCost(FILE* f, const char* indent, const char* name, const CostFlow& flow, int nops)
+{
+	CostRange total = flow.fall | flow.ended;
+	fprintf(f, "%s%s: ", indent, name);
+	if (!total.valid)
+		fprintf(f, "does not finish");
+	else
+	{
+		printRange(f, total, 0, "instructions");
+		fprintf(f, ", ");
+		printRange(f, total, 1, "cycles");
+	}
+	fprintf(f, ", %d padding NOPs\n", nops);
+}
+
+static int countNops(const std::vector<bool>& reached, size_t start, size_t end)
+{
+	int nops = 0;
+	for (size_t i = start; i < end && i < BUF.size(); i ++)
+		if (reached[i] && (BUF[i] >> 26) == MAESTRO_NOP)
+			nops ++;
+	return nops;
+}
+
+static std::string procName(size_t start, size_t size)
+{
+	std::string name;
+	for (procTableIter it = g_procTable.begin(); it != g_procTable.end(); ++it)
+	{
+		if (it->second.first != start)
+			continue;
+		if (it->second.second == size)
+			return it->first;
+		if (name.empty())
+			name = it->first;
+	}
+	if (name.empty())
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "0x%03X", (unsigned)start);
+		name = buf;
+	}
+	return name;
+}
+
+void CostReport(FILE* f)
+{
+	costLatency = GetLatencyTable();
+
+	int index = 0;
+	for (dvleTableIter dvle = g_dvleTable.begin(); dvle != g_dvleTable.end(); ++dvle)
+	{
+		if (dvle->nodvle) continue;
+
+		CostWalker walker(&*dvle);
+		CostFlow flow = walker.walk(dvle->entryStart, dvle->entryEnd);
+
+		std::string name = dvle->filename;
+		if (!dvle->variantName.empty())
+			name += " (" + dvle->variantName + ")";
+		fprintf(f, "dvle %d %s, entry %s\n", index ++, name.c_str(), dvle->entrypoint.c_str());
+		printCost(f, "  ", "total", flow, countNops(walker.reached, 0, BUF.size()));
+		if (flow.fall.valid)
+			fprintf(f, "  warning: the entrypoint may finish without reaching END\n");
+		if (walker.unstructured)
+			fprintf(f, "  warning: jumps backwards or out of blocks, or calls nested too deeply, were not followed\n");
+
+		// Procedures include the cost of the procedures they call
+		printCost(f, "  ", dvle->entrypoint.c_str(), flow, countNops(walker.reached, dvle->entryStart, dvle->entryEnd));
+		for (std::map<size_t, size_t>::iterator it = walker.calls.begin(); it != walker.calls.end(); ++it)
+		{
+			size_t start = it->first, size = it->second;
+			printCost(f, "  ", procName(start, size).c_str(), walker.walk(start, start + size), countNops(walker.reached, start, start + size));
+		}
+	}
+}
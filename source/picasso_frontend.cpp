@@ -1,36 +1,7 @@
 #include "picasso.h"
-
-// f24 has:
-//  - 1 sign bit
-//  - 7 exponent bits
-//  - 16 mantissa bits
-uint32_t f32tof24(float f)
-{
-	uint32_t i;
-	memcpy(&i, &f, sizeof(f));
-
-	uint32_t mantissa = (i << 9) >>  9;
-	int32_t  exponent = (i << 1) >> 24;
-	uint32_t sign     = (i << 0) >> 31;
-
-	// Truncate mantissa
-	mantissa >>= 7;
-
-	// Re-bias exponent
-	exponent = exponent - 127 + 63;
-	if (exponent < 0)
-	{
-		// Underflow: flush to zero
-		return sign << 23;
-	}
-	else if (exponent > 0x7F)
-	{
-		// Overflow: saturate to infinity
-		return (sign << 23) | (0x7F << 16);
-	}
-
-	return (sign << 23) | (exponent << 16) | mantissa;
-}
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
 
 #ifdef WIN32
 static inline void FixMinGWPath(char* buf)
@@ -43,6 +14,37 @@ static inline void FixMinGWPath(char* buf)
 }
 #endif
 
+// Time spent in each phase of a run, for --timings
+struct PhaseTimes
+{
+	double assemble, fixup, relocate, write;
+	u64 lines, insns;
+};
+
+static void printTimings(const PhaseTimes& t)
+{
+	// The assembly time includes the fixups
+	double total = t.assemble + t.relocate + t.write;
+	fprintf(stderr, "timings:\n");
+	fprintf(stderr, "  assemble:  %10.3f ms\n", (t.assemble - t.fixup)*1e3);
+	fprintf(stderr, "  fixup:     %10.3f ms\n", t.fixup*1e3);
+	fprintf(stderr, "  relocate:  %10.3f ms\n", t.relocate*1e3);
+	fprintf(stderr, "  write:     %10.3f ms\n", t.write*1e3);
+	fprintf(stderr, "  total:     %10.3f ms\n", total*1e3);
+	fprintf(stderr, "  lines:     %10llu (%.3f M/s)\n", (unsigned long long)t.lines, total > 0 ? t.lines/total*1e-6 : 0.0);
+	fprintf(stderr, "  insns:     %10llu (%.3f M/s)\n", (unsigned long long)t.insns, total > 0 ? t.insns/total*1e-6 : 0.0);
+#ifdef HAVE_GETRUSAGE
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+	{
+#ifdef __APPLE__
+		ru.ru_maxrss /= 1024; // Reported in bytes
+#endif
+		fprintf(stderr, "  peak rss:  %10ld KiB\n", (long)ru.ru_maxrss);
+	}
+#endif
+}
+
 int usage(const char* prog)
 {
 	fprintf(stderr,
@@ -51,6 +53,12 @@ int usage(const char* prog)
 		"  -o, --out=<file>        Specifies the name of the SHBIN file to generate\n"
 		"  -h, --header=<file>     Specifies the name of the header file to generate\n"
 		"  -n, --no-nop            Disables the automatic insertion of padding NOPs\n"
+		"  -O, --optimize=<level>  Specifies the optimization level (0 to 3, default 0)\n"
+		"  -r, --opt-report        Reports the changes made by the optimizer\n"
+		"  -l, --line-table=<file> Specifies the name of the source line table file to generate\n"
+		"  -c, --cost-report       Reports the instructions and cycles each DVLE and procedure can take\n"
+		"  -L, --latency=<file>    Reads the cycle count of each instruction for --cost-report\n"
+		"  -t, --timings           Reports the time spent in each phase of the assembler\n"
 		"  -v, --version           Displays version information\n"
 		, prog);
 	return EXIT_FAILURE;
@@ -58,7 +66,9 @@ int usage(const char* prog)
 
 int main(int argc, char* argv[])
 {
-	char *shbinFile = NULL, *hFile = NULL;
+	char *shbinFile = NULL, *hFile = NULL, *lineFile = NULL;
+	bool costReport = false, timings = false;
+	PhaseTimes times = { 0, 0, 0, 0, 0, 0 };
 
 	static struct option long_options[] =
 	{
@@ -66,12 +76,18 @@ int main(int argc, char* argv[])
 		{ "header", required_argument, NULL, 'h' },
 		{ "help",   no_argument,       NULL, '?' },
 		{ "no-nop", no_argument,       NULL, 'n' },
+		{ "optimize",   required_argument, NULL, 'O' },
+		{ "opt-report", no_argument,       NULL, 'r' },
+		{ "line-table", required_argument, NULL, 'l' },
+		{ "cost-report", no_argument,      NULL, 'c' },
+		{ "latency",    required_argument, NULL, 'L' },
+		{ "timings",    no_argument,       NULL, 't' },
 		{ "version",no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	int opt, optidx = 0;
-	while ((opt = getopt_long(argc, argv, "o:h:?nv", long_options, &optidx)) != -1)
+	while ((opt = getopt_long(argc, argv, "o:h:?nO:rl:cL:tv", long_options, &optidx)) != -1)
 	{
 		switch (opt)
 		{
@@ -79,6 +95,19 @@ int main(int argc, char* argv[])
 			case 'h': hFile     = optarg; break;
 			case '?': usage(argv[0]); return EXIT_SUCCESS;
 			case 'n': g_autoNop = false; break;
+			case 'O':
+				if (optarg[0] < '0' || optarg[0] > '3' || optarg[1])
+				{
+					fprintf(stderr, "%s: invalid optimization level: %s\n", argv[0], optarg);
+					return usage(argv[0]);
+				}
+				g_optLevel = optarg[0] - '0';
+				break;
+			case 'r': g_optReport = true; break;
+			case 'l': lineFile  = optarg; break;
+			case 'c': costReport = true; break;
+			case 'L': if (LoadLatencyTable(optarg) != 0) return EXIT_FAILURE; break;
+			case 't': timings = true; break;
 			case 'v': printf("%s - Built on %s %s\n", PACKAGE_STRING, __DATE__, __TIME__); return EXIT_SUCCESS;
 			default:  return usage(argv[0]);
 		}
@@ -87,6 +116,7 @@ int main(int argc, char* argv[])
 #ifdef WIN32
 	FixMinGWPath(shbinFile);
 	FixMinGWPath(hFile);
+	FixMinGWPath(lineFile);
 #endif
 
 	if (optind == argc)
@@ -117,16 +147,31 @@ int main(int argc, char* argv[])
 			return EXIT_FAILURE;
 		}
 
+		for (const char* p = sourceCode; (p = strchr(p, '\n')); p ++)
+			times.lines ++;
+
+		double start = GetWallTime();
 		rc = AssembleString(sourceCode, vshFile);
+		times.assemble += GetWallTime() - start;
 		free(sourceCode);
 		if (rc != 0)
 			return EXIT_FAILURE;
 	}
 
+	times.fixup = g_fixupTime;
+	times.insns = g_outputBuf.size();
+
+	double start = GetWallTime();
 	rc = RelocateProduct();
+	times.relocate = GetWallTime() - start;
 	if (rc != 0)
 		return EXIT_FAILURE;
 
+	if (costReport)
+		CostReport(stdout);
+
+	start = GetWallTime();
+
 	FileClass f(shbinFile, "wb");
 
 	if (f.openerror())
@@ -288,7 +333,14 @@ int main(int argc, char* argv[])
 			const char* name = u.name.c_str();
 			if (*name == '_') continue; // Hidden uniform
 			if (u.type == UTYPE_FVEC)
+			{
 				fprintf(f2, "#define %s_FVEC_%s 0x%02X\n", prefix, name, u.pos-0x20);
+				if (u.compCount < 4)
+				{
+					fprintf(f2, "#define %s_COMP_%s %d\n", prefix, name, u.comp);
+					fprintf(f2, "#define %s_CLEN_%s %d\n", prefix, name, u.compCount);
+				}
+			}
 			else if (u.type == UTYPE_IVEC)
 				fprintf(f2, "#define %s_IVEC_%s 0x%02X\n", prefix, name, u.pos-0x80);
 			else if (u.type == UTYPE_BOOL)
@@ -301,8 +353,69 @@ int main(int argc, char* argv[])
 			fprintf(f2, "#define %s_ULEN_%s %d\n", prefix, name, u.size);
 		}
 
+		// Register ranges to upload for each update class
+		static const char* const typeNames[3] = { "BOOL", "IVEC", "FVEC" };
+		for (size_t i = 0; i < g_updateClasses.size(); i ++)
+		{
+			UpdateClass& uc = g_updateClasses[i];
+			for (int type = UTYPE_FVEC; type >= UTYPE_BOOL; type --)
+			{
+				if (!uc.count[type]) continue;
+				fprintf(f2, "#define %s_%s_CLASS_%s 0x%02X\n", prefix, typeNames[type], uc.name.c_str(), uc.start[type]);
+				fprintf(f2, "#define %s_%s_CLASS_LEN_%s %d\n", prefix, typeNames[type], uc.name.c_str(), uc.count[type]);
+			}
+		}
+
+		fclose(f2);
+	}
+
+	if (lineFile)
+	{
+		FILE* f2 = fopen(lineFile, "w");
+		if (!f2)
+		{
+			fprintf(stderr, "Can't open line table file!\n");
+			return 1;
+		}
+
+		// Each word belongs to the smallest procedure containing it, since
+		// procedures extend over the procedures they fall through into
+		std::vector<procTableIter> procs;
+		std::vector<int> owner(g_outputBuf.size(), -1);
+		for (procTableIter it = g_procTable.begin(); it != g_procTable.end(); ++it)
+		{
+			size_t start = it->second.first, size = it->second.second;
+			for (size_t i = start; i < start+size && i < owner.size(); i ++)
+				if (owner[i] < 0 || procs[owner[i]]->second.second > size)
+					owner[i] = procs.size();
+			procs.push_back(it);
+		}
+
+		// Source file, line and procedure of each program word
+		fprintf(f2, "# Generated by picasso\n");
+		for (size_t i = 0; i < g_sourceFiles.size(); i ++)
+			fprintf(f2, "file %u %s\n", (unsigned)i, g_sourceFiles[i].c_str());
+		for (size_t i = 0; i < procs.size(); i ++)
+		{
+			procedure& p = procs[i]->second;
+			fprintf(f2, "proc %u %u %u %s\n", (unsigned)i, (unsigned)p.first, (unsigned)p.second, procs[i]->first.c_str());
+		}
+		for (size_t i = 0; i < owner.size(); i ++)
+		{
+			SourceLoc loc = { -1, 0 };
+			if (i < g_sourceLocTable.size())
+				loc = g_sourceLocTable[i];
+			fprintf(f2, "%u %d %d %d\n", (unsigned)i, loc.file, loc.line, owner[i]);
+		}
+
 		fclose(f2);
 	}
 
+	if (timings)
+	{
+		times.write = GetWallTime() - start;
+		printTimings(times);
+	}
+
 	return EXIT_SUCCESS;
 }
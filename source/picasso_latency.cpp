@@ -0,0 +1,87 @@
+#include "picasso.h"
+
+// Estimated cycles taken by each opcode, shared by the cost report of the
+// assembler and by the simulator
+
+static int latencyTable[0x40];
+static bool latencyLoaded;
+
+static const char* const latencyNames[0x40] =
+{
+	"add", "dp3", "dp4", "dph", "dst", "ex2", "lg2", "litp",
+	"mul", "sge", "slt", "flr", "max", "min", "rcp", "rsq",
+	NULL, NULL, "mova", "mov", NULL, NULL, NULL, NULL,
+	"dph", "dst", "sge", "slt", NULL, NULL, NULL, NULL,
+	"break", "nop", "end", "breakc", "call", "callc", "callu", "ifu",
+	"ifc", "for", "emit", "setemit", "jmpc", "jmpu", "cmp", "cmp",
+	"mad", "mad", "mad", "mad", "mad", "mad", "mad", "mad",
+	"mad", "mad", "mad", "mad", "mad", "mad", "mad", "mad",
+};
+
+static int latencyError(const char* msg, ...)
+{
+	va_list v;
+
+	fprintf(stderr, "error: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+
+	return 1;
+}
+
+// Every instruction takes one cycle unless a latency table says otherwise
+const int* GetLatencyTable(void)
+{
+	if (!latencyLoaded)
+	{
+		for (int i = 0; i < 0x40; i ++)
+			latencyTable[i] = 1;
+		latencyLoaded = true;
+	}
+	return latencyTable;
+}
+
+int LoadLatencyTable(const char* filename)
+{
+	GetLatencyTable();
+
+	FILE* f = fopen(filename, "r");
+	if (!f)
+		return latencyError("cannot open latency table: %s\n", filename);
+
+	char line[256];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		lineNo ++;
+		char* p = line + strspn(line, " \t");
+		if (!*p || *p == '#' || *p == '\r' || *p == '\n')
+			continue;
+
+		char name[32];
+		int cycles;
+		if (sscanf(p, "%31s %d", name, &cycles) != 2 || cycles < 0)
+		{
+			fclose(f);
+			return latencyError("%s:%d: expected an instruction name and a cycle count\n", filename, lineNo);
+		}
+
+		bool found = false;
+		for (int i = 0; i < 0x40; i ++)
+			if (latencyNames[i] && stricmp(latencyNames[i], name) == 0)
+			{
+				latencyTable[i] = cycles;
+				found = true;
+			}
+		if (!found)
+		{
+			fclose(f);
+			return latencyError("%s:%d: unknown instruction: %s\n", filename, lineNo, name);
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,2808 @@
+#include "picasso.h"
+
+// The link-time optimizer decodes the assembled program back into a tree of
+// procedures and blocks, runs the optimization passes over it and emits it
+// again, following the same padding NOP rules as the assembler.
+
+#define BUF g_outputBuf
+
+static irProcTableType irProcTable;
+static int irLabelCount;
+
+typedef std::map<size_t, std::string> callMapType;
+typedef std::map<size_t, int> labelMapType;
+static callMapType irCallMap;
+static labelMapType irLabelMap;
+static std::vector<DVLEData*> irDvles; // DVLEs that get generated
+
+enum
+{
+	BLK_PROC,
+	BLK_IF,
+	BLK_ELSE,
+	BLK_FOR,
+};
+
+static int optErrorAt(const SourceLoc& loc, const char* msg, ...)
+{
+	va_list v;
+
+	if (loc.file >= 0 && loc.file < (int)g_sourceFiles.size())
+		fprintf(stderr, "%s:%d: ", g_sourceFiles[loc.file].c_str(), loc.line);
+	fprintf(stderr, "error: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+
+	return 1;
+}
+
+static int optSkip(const char* msg, ...)
+{
+	va_list v;
+
+	fprintf(stderr, "warning: link-time optimization disabled: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+
+	return 1;
+}
+
+static void optNote(const char* msg, ...)
+{
+	if (!g_optReport)
+		return;
+
+	va_list v;
+
+	fprintf(stderr, "note: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+}
+
+static void optNoteAt(const SourceLoc& loc, const char* msg, ...)
+{
+	if (!g_optReport)
+		return;
+
+	va_list v;
+
+	if (loc.file < (int)g_sourceFiles.size())
+		fprintf(stderr, "%s:%d: ", g_sourceFiles[loc.file].c_str(), loc.line);
+	fprintf(stderr, "note: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+}
+
+// --------------------------------------------------------------------
+// Instruction decoding
+// --------------------------------------------------------------------
+
+static int irSrcCount(int opcode)
+{
+	switch (opcode)
+	{
+		case MAESTRO_ADD:
+		case MAESTRO_DP3:
+		case MAESTRO_DP4:
+		case MAESTRO_DPH:
+		case MAESTRO_DST:
+		case MAESTRO_MUL:
+		case MAESTRO_SGE:
+		case MAESTRO_SLT:
+		case MAESTRO_MAX:
+		case MAESTRO_MIN:
+		case MAESTRO_CMP:
+			return 2;
+		case MAESTRO_MAD:
+			return 3;
+		default:
+			return 1;
+	}
+}
+
+static int irInvertedOpcode(int opcode)
+{
+	switch (opcode)
+	{
+		case MAESTRO_DPH: return MAESTRO_DPHI;
+		case MAESTRO_DST: return MAESTRO_DSTI;
+		case MAESTRO_SGE: return MAESTRO_SGEI;
+		case MAESTRO_SLT: return MAESTRO_SLTI;
+		default:          return -1;
+	}
+}
+
+static inline bool irIsCommutative(int opcode)
+{
+	switch (opcode)
+	{
+		case MAESTRO_ADD:
+		case MAESTRO_DP3:
+		case MAESTRO_DP4:
+		case MAESTRO_MUL:
+		case MAESTRO_MAX:
+		case MAESTRO_MIN:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static inline bool irIsComponentwise(int opcode)
+{
+	switch (opcode)
+	{
+		case MAESTRO_ADD:
+		case MAESTRO_MUL:
+		case MAESTRO_MAX:
+		case MAESTRO_MIN:
+		case MAESTRO_SGE:
+		case MAESTRO_SLT:
+		case MAESTRO_FLR:
+		case MAESTRO_MOV:
+		case MAESTRO_MAD:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static inline int swizzleSel(int sw, int c)
+{
+	return (sw >> (7-2*c)) & 3;
+}
+
+// Components of the source register read by an instruction
+static int srcReads(const IrInsn& in, int i)
+{
+	int used = 0xF;
+	if (irIsComponentwise(in.opcode))
+		used = in.mask;
+	else if (in.opcode == MAESTRO_DP3 || (in.opcode == MAESTRO_DPH && i == 0))
+		used = 0xE;
+
+	int ret = 0;
+	for (int c = 0; c < 4; c ++)
+		if (used & (8>>c))
+			ret |= 8 >> swizzleSel(in.srcSw[i], c);
+	return ret;
+}
+
+static bool readsReg(const IrInsn& in, int reg, int mask)
+{
+	for (int i = 0; i < irSrcCount(in.opcode); i ++)
+		if (in.src[i] == reg && !in.idx[i] && (srcReads(in, i) & mask))
+			return true;
+	return false;
+}
+
+static inline bool writesReg(const IrInsn& in, int reg, int mask)
+{
+	return in.opcode != MAESTRO_CMP && in.opcode != MAESTRO_MOVA && in.dest == reg && (in.mask & mask);
+}
+
+static void decodeOpdesc(IrInsn& in, int opdesc)
+{
+	in.mask = opdesc & 0xF;
+	for (int i = 0; i < 3; i ++)
+		in.srcSw[i] = i < irSrcCount(in.opcode) ? (opdesc >> (4+9*i)) & 0x1FF : 0;
+}
+
+static void decodeInsn(u32 w, IrNode& n)
+{
+	IrInsn& in = n.insn;
+	memset(&in, 0, sizeof(in));
+	n.type = IR_INSN;
+	int op = w >> 26;
+
+	if (op >= MAESTRO_MADI)
+	{
+		bool inverted = op < MAESTRO_MAD;
+		in.opcode = MAESTRO_MAD;
+		in.dest = (w>>24) & 0x1F;
+		in.src[0] = (w>>17) & 0x1F;
+		in.src[1] = inverted ? (w>>12) & 0x1F : (w>>10) & 0x7F;
+		in.src[2] = (w>>5) & (inverted ? 0x7F : 0x1F);
+		in.idx[inverted ? 2 : 1] = (w>>22) & 3;
+		decodeOpdesc(in, g_opdescTable[w & 0x1F]);
+	} else if ((op &~ 1) == MAESTRO_CMP)
+	{
+		in.opcode = MAESTRO_CMP;
+		in.src[0] = (w>>12) & 0x7F;
+		in.src[1] = (w>>7) & 0x1F;
+		in.idx[0] = (w>>19) & 3;
+		in.cmpy = (w>>21) & 7;
+		in.cmpx = (w>>24) & 7;
+		decodeOpdesc(in, g_opdescTable[w & 0x7F]);
+		in.mask = 0;
+	} else if (op < 0x20)
+	{
+		bool inverted = true;
+		switch (op)
+		{
+			case MAESTRO_DPHI: in.opcode = MAESTRO_DPH; break;
+			case MAESTRO_DSTI: in.opcode = MAESTRO_DST; break;
+			case MAESTRO_SGEI: in.opcode = MAESTRO_SGE; break;
+			case MAESTRO_SLTI: in.opcode = MAESTRO_SLT; break;
+			default: in.opcode = op; inverted = false; break;
+		}
+		in.dest = op == MAESTRO_MOVA ? 0 : (w>>21) & 0x1F;
+		if (inverted)
+		{
+			in.src[0] = (w>>14) & 0x1F;
+			in.src[1] = (w>>7) & 0x7F;
+			in.idx[1] = (w>>19) & 3;
+		} else
+		{
+			in.src[0] = (w>>12) & 0x7F;
+			in.src[1] = irSrcCount(op) > 1 ? (w>>7) & 0x1F : 0;
+			in.idx[0] = (w>>19) & 3;
+		}
+		decodeOpdesc(in, g_opdescTable[w & 0x7F]);
+	} else
+	{
+		// Flow of control instructions without targets are kept verbatim
+		in.opcode = op;
+		n.word = w;
+		return;
+	}
+
+	n.word = FMT_OPCODE(in.opcode);
+	n.decoded = in;
+}
+
+// --------------------------------------------------------------------
+// Instruction encoding
+// --------------------------------------------------------------------
+
+static inline bool isBadInputRegCombination(const IrInsn& in)
+{
+	int n = irSrcCount(in.opcode), first = -1;
+	for (int i = 0; i < n; i ++)
+	{
+		if (in.src[i] >= 0x10) continue;
+		if (first >= 0 && in.src[i] != first)
+			return true;
+		first = in.src[i];
+	}
+	return false;
+}
+
+static inline bool isWide(const IrInsn& in, int i)
+{
+	return in.src[i] < 0x80;
+}
+
+static inline bool isNarrow(const IrInsn& in, int i)
+{
+	return in.src[i] < 0x20 && !in.idx[i];
+}
+
+static void swapSources(IrInsn& in, int a, int b)
+{
+	std::swap(in.src[a], in.src[b]);
+	std::swap(in.srcSw[a], in.srcSw[b]);
+	std::swap(in.idx[a], in.idx[b]);
+}
+
+// Checks whether the instruction fits in one of the encodings, swapping the
+// operands of commutative instructions if that helps
+static bool legalizeInsn(IrInsn& in)
+{
+	if (isBadInputRegCombination(in))
+		return false;
+
+	switch (in.opcode)
+	{
+		case MAESTRO_MAD:
+			if (!isNarrow(in, 0))
+				return false;
+			if (isWide(in, 1) && isNarrow(in, 2))
+				return true;
+			return isNarrow(in, 1) && isWide(in, 2);
+
+		case MAESTRO_CMP:
+			return isWide(in, 0) && isNarrow(in, 1);
+
+		case MAESTRO_EX2:
+		case MAESTRO_LG2:
+		case MAESTRO_LITP:
+		case MAESTRO_FLR:
+		case MAESTRO_RCP:
+		case MAESTRO_RSQ:
+		case MAESTRO_MOV:
+		case MAESTRO_MOVA:
+			return isWide(in, 0);
+	}
+
+	if (isWide(in, 0) && isNarrow(in, 1))
+		return true;
+	if (irInvertedOpcode(in.opcode) >= 0 && isNarrow(in, 0) && isWide(in, 1))
+		return true;
+	if (irIsCommutative(in.opcode) && isNarrow(in, 0) && isWide(in, 1))
+	{
+		swapSources(in, 0, 1);
+		return true;
+	}
+	return false;
+}
+
+// Instructions no pass changed are encoded in their original form, without
+// the checks legalizeInsn applies to the instructions made by the optimizer
+static int encodeInsn(IrInsn in, u32& out, bool verbatim, const SourceLoc& loc)
+{
+	if (!verbatim && !legalizeInsn(in))
+		return optErrorAt(loc, "cannot encode optimized instruction (opcode 0x%02X)\n", in.opcode);
+
+	int opdesc = 0;
+	switch (in.opcode)
+	{
+		case MAESTRO_MAD:
+		{
+			safe_call(AllocOpdesc(MAESTRO_MAD, opdesc, OPDESC_MAKE(in.mask, in.srcSw[0], in.srcSw[1], in.srcSw[2]), OPDESC_MASK_D123));
+			if (isWide(in, 1) && isNarrow(in, 2))
+				out = FMT_OPCODE(MAESTRO_MAD)  | opdesc | (in.src[2]<<5) | (in.src[1]<<10) | (in.src[0]<<17) | (in.idx[1]<<22) | (in.dest<<24);
+			else
+				out = FMT_OPCODE(MAESTRO_MADI) | opdesc | (in.src[2]<<5) | (in.src[1]<<12) | (in.src[0]<<17) | (in.idx[2]<<22) | (in.dest<<24);
+			return 0;
+		}
+
+		case MAESTRO_CMP:
+			safe_call(AllocOpdesc(in.opcode, opdesc, OPDESC_MAKE(0, in.srcSw[0], in.srcSw[1], 0), OPDESC_MASK_12));
+			out = FMT_OPCODE(MAESTRO_CMP) | opdesc | (in.src[1]<<7) | (in.src[0]<<12) | (in.idx[0]<<19) | (in.cmpy<<21) | (in.cmpx<<24);
+			return 0;
+
+		case MAESTRO_MOVA:
+			safe_call(AllocOpdesc(in.opcode, opdesc, OPDESC_MAKE(in.mask, in.srcSw[0], 0, 0), OPDESC_MASK_D1));
+			out = FMT_OPCODE(MAESTRO_MOVA) | opdesc | (in.src[0]<<12) | (in.idx[0]<<19);
+			return 0;
+	}
+
+	if (irSrcCount(in.opcode) == 1)
+	{
+		safe_call(AllocOpdesc(in.opcode, opdesc, OPDESC_MAKE(in.mask, in.srcSw[0], 0, 0), OPDESC_MASK_D1));
+		out = FMT_OPCODE(in.opcode) | opdesc | (in.src[0]<<12) | (in.idx[0]<<19) | (in.dest<<21);
+		return 0;
+	}
+
+	safe_call(AllocOpdesc(in.opcode, opdesc, OPDESC_MAKE(in.mask, in.srcSw[0], in.srcSw[1], 0), OPDESC_MASK_D12));
+	if (isWide(in, 0) && isNarrow(in, 1))
+		out = FMT_OPCODE(in.opcode) | opdesc | (in.src[1]<<7) | (in.src[0]<<12) | (in.idx[0]<<19) | (in.dest<<21);
+	else
+		out = FMT_OPCODE(irInvertedOpcode(in.opcode)) | opdesc | (in.src[1]<<7) | (in.src[0]<<14) | (in.idx[1]<<19) | (in.dest<<21);
+	return 0;
+}
+
+// --------------------------------------------------------------------
+// Program decoding
+// --------------------------------------------------------------------
+
+static bool needsPadding(const IrList& list, int kind)
+{
+	// Labels are not instructions, so skip them
+	const IrNode* last = NULL;
+	for (IrList::const_reverse_iterator it = list.rbegin(); it != list.rend(); ++it)
+		if (it->type != IR_LABEL)
+		{
+			last = &*it;
+			break;
+		}
+
+	if (!last)
+		return kind != BLK_ELSE;
+
+	switch (last->type)
+	{
+		case IR_IF:
+		case IR_FOR:
+		case IR_CALL:
+		case IR_JUMP:
+			return true;
+		case IR_INSN:
+			return kind == BLK_FOR && (last->isOp(MAESTRO_BREAK) || last->isOp(MAESTRO_BREAKC));
+	}
+	return false;
+}
+
+static SourceLoc sourceLoc(size_t pos)
+{
+	if (pos < g_sourceLocTable.size())
+		return g_sourceLocTable[pos];
+	SourceLoc loc = { 0, 0 };
+	return loc;
+}
+
+static void placeLabel(IrList& list, size_t pos)
+{
+	labelMapType::iterator it = irLabelMap.find(pos);
+	if (it == irLabelMap.end())
+		return;
+
+	IrNode n;
+	memset(&n.decoded, 0xFF, sizeof(n.decoded)); // Matches no instruction
+	n.type = IR_LABEL;
+	n.word = 0;
+	n.label = it->second;
+	n.loc = sourceLoc(pos);
+	list.push_back(n);
+	irLabelMap.erase(it);
+}
+
+static int decodeList(IrList& list, size_t start, size_t end, int kind)
+{
+	size_t pc = start;
+	while (pc < end)
+	{
+		placeLabel(list, pc);
+
+		u32 w = BUF[pc];
+		int op = w >> 26;
+		IrNode n;
+		memset(&n.decoded, 0xFF, sizeof(n.decoded));
+		n.label = -1;
+		n.loc = sourceLoc(pc);
+
+		switch (op)
+		{
+			case MAESTRO_IFU:
+			case MAESTRO_IFC:
+			{
+				size_t dst = (w>>10) & 0xFFF, num = w & 0x3FF;
+				if (dst <= pc || dst > end || dst+num > end)
+					return optSkip("malformed IF block at 0x%03X\n", (unsigned)pc);
+				n.type = IR_IF;
+				n.word = w &~ 0x3FFFFF;
+				list.push_back(n);
+				IrNode& node = list.back();
+				safe_call(decodeList(node.body, pc+1, dst, BLK_IF));
+				safe_call(decodeList(node.elseBody, dst, dst+num, BLK_ELSE));
+				pc = dst+num;
+				continue;
+			}
+
+			case MAESTRO_FOR:
+			{
+				size_t dst = (w>>10) & 0xFFF;
+				if (dst <= pc || dst >= end)
+					return optSkip("malformed FOR block at 0x%03X\n", (unsigned)pc);
+				n.type = IR_FOR;
+				n.word = w &~ 0x3FFFFF;
+				list.push_back(n);
+				safe_call(decodeList(list.back().body, pc+1, dst+1, BLK_FOR));
+				pc = dst+1;
+				continue;
+			}
+
+			case MAESTRO_CALL:
+			case MAESTRO_CALLC:
+			case MAESTRO_CALLU:
+			{
+				callMapType::iterator it = irCallMap.find(pc);
+				if (it == irCallMap.end() || irProcTable.find(it->second) == irProcTable.end())
+					return optSkip("unresolved call at 0x%03X\n", (unsigned)pc);
+				n.type = IR_CALL;
+				n.word = w &~ 0x3FFFFF;
+				n.target = it->second;
+				break;
+			}
+
+			case MAESTRO_JMPC:
+			case MAESTRO_JMPU:
+				n.type = IR_JUMP;
+				n.word = w &~ (0xFFF << 10);
+				n.label = irLabelMap[(w>>10) & 0xFFF];
+				break;
+
+			default:
+				decodeInsn(w, n);
+				break;
+		}
+
+		list.push_back(n);
+		pc ++;
+	}
+
+	if (kind == BLK_PROC)
+		placeLabel(list, end);
+
+	// Padding NOPs are regenerated on emission
+	if (g_autoNop && !list.empty() && list.back().isOp(MAESTRO_NOP))
+	{
+		IrNode nop = list.back();
+		list.pop_back();
+		if (!needsPadding(list, kind))
+			list.push_back(nop);
+	}
+
+	return 0;
+}
+
+static int decodeProgram(void)
+{
+	irProcTable.clear();
+	irCallMap.clear();
+	irLabelMap.clear();
+	irLabelCount = 0;
+
+	irDvles.clear();
+	for (dvleTableIter it = g_dvleTable.begin(); it != g_dvleTable.end(); ++it)
+		if (!it->nodvle)
+			irDvles.push_back(&*it);
+
+	for (relocTableIter it = g_procRelocTable.begin(); it != g_procRelocTable.end(); ++it)
+		irCallMap[it->first] = it->second;
+
+	// Procedures must tile the program without overlapping
+	std::vector<std::pair<size_t, std::string> > ranges;
+	for (procTableIter it = g_procTable.begin(); it != g_procTable.end(); ++it)
+		ranges.push_back(std::make_pair(it->second.first, it->first));
+	std::sort(ranges.begin(), ranges.end());
+
+	size_t expected = 0;
+	for (size_t i = 0; i < ranges.size(); i ++)
+	{
+		IrProc& p = irProcTable[ranges[i].second];
+		p.name = ranges[i].second;
+		p.order = i;
+		p.pos = ranges[i].first;
+		p.size = g_procTable[p.name].second;
+		if (p.pos != expected)
+			return optSkip(p.pos < expected ? "procedure '%s' overlaps another procedure\n" : "code outside of procedures before '%s'\n", p.name.c_str());
+		expected = p.pos + p.size;
+	}
+	if (expected != BUF.size())
+		return optSkip("code outside of procedures\n");
+
+	for (dvleTableIter it = g_dvleTable.begin(); it != g_dvleTable.end(); ++it)
+	{
+		irProcTableIter p = irProcTable.find(it->entrypoint);
+		if (!it->nodvle && p != irProcTable.end())
+			p->second.isEntry = true;
+	}
+
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+	{
+		IrProc& p = it->second;
+
+		// Jumps may only target labels within the same procedure
+		for (size_t pc = p.pos; pc < p.pos+p.size; pc ++)
+		{
+			int op = BUF[pc] >> 26;
+			if (op != MAESTRO_JMPC && op != MAESTRO_JMPU)
+				continue;
+			size_t dst = (BUF[pc]>>10) & 0xFFF;
+			if (dst < p.pos || dst > p.pos+p.size)
+				return optSkip("jump out of procedure '%s'\n", p.name.c_str());
+			if (irLabelMap.find(dst) == irLabelMap.end())
+				irLabelMap[dst] = irLabelCount++;
+		}
+
+		safe_call(decodeList(p.body, p.pos, p.pos+p.size, BLK_PROC));
+		if (!irLabelMap.empty())
+			return optSkip("unplaceable label in procedure '%s'\n", p.name.c_str());
+	}
+
+	return 0;
+}
+
+// --------------------------------------------------------------------
+// Program emission
+// --------------------------------------------------------------------
+
+// Instruction whose operands are encoded once the program is laid out
+struct IrInsnFixup
+{
+	size_t pos;
+	IrInsn insn;
+	bool verbatim; // Unchanged since decoding
+	SourceLoc loc;
+};
+
+struct IrEmitter
+{
+	bool dryRun;
+	size_t pos;
+	std::vector<IrInsnFixup> insnFixups;
+	std::vector<std::pair<size_t, int> > jumpFixups;
+	std::map<int, size_t> labelPos;
+	relocTableType relocs;
+	const char* procName;
+	SourceLoc lastLoc;
+
+	IrEmitter(bool dryRun) : dryRun(dryRun), pos(0), procName(NULL) { lastLoc = sourceLoc(0); }
+
+	void push(u32 word, const SourceLoc& loc)
+	{
+		if (!dryRun)
+		{
+			BUF.push_back(word);
+			g_sourceLocTable.push_back(loc);
+		}
+		lastLoc = loc;
+		pos ++;
+	}
+
+	void patch(size_t at, u32 bits)
+	{
+		if (!dryRun)
+			BUF[at] |= bits;
+	}
+};
+
+static void emitList(IrEmitter& e, IrList& list, int kind, bool pad = true);
+
+static void emitNode(IrEmitter& e, IrNode& n)
+{
+	switch (n.type)
+	{
+		case IR_INSN:
+			if (n.hasOperands() && !e.dryRun)
+			{
+				IrInsnFixup f = { e.pos, n.insn, memcmp(&n.insn, &n.decoded, sizeof(IrInsn)) == 0, n.loc };
+				e.insnFixups.push_back(f);
+			}
+			e.push(n.hasOperands() ? 0 : n.word, n.loc);
+			break;
+
+		case IR_CALL:
+			e.relocs.push_back(std::make_pair(e.pos, n.target));
+			e.push(n.word, n.loc);
+			break;
+
+		case IR_JUMP:
+			e.jumpFixups.push_back(std::make_pair(e.pos, n.label));
+			e.push(n.word, n.loc);
+			break;
+
+		case IR_LABEL:
+			e.labelPos[n.label] = e.pos;
+			break;
+
+		case IR_IF:
+		{
+			size_t p = e.pos;
+			e.push(n.word, n.loc);
+			emitList(e, n.body, BLK_IF);
+			size_t dst = e.pos;
+			emitList(e, n.elseBody, BLK_ELSE);
+			e.patch(p, (dst << 10) | (e.pos - dst));
+			break;
+		}
+
+		case IR_FOR:
+		{
+			size_t p = e.pos;
+			e.push(n.word, n.loc);
+			emitList(e, n.body, BLK_FOR);
+			e.patch(p, (e.pos-1) << 10);
+			break;
+		}
+	}
+}
+
+static void emitList(IrEmitter& e, IrList& list, int kind, bool pad)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+		emitNode(e, *it);
+
+	if (!pad || !needsPadding(list, kind))
+		return;
+
+	if (g_autoNop)
+		e.push(FMT_OPCODE(MAESTRO_NOP), e.lastLoc);
+	else if (!e.dryRun)
+		fprintf(stderr, "warning: a padding NOP is required at 0x%03X (procedure '%s')\n", (unsigned)e.pos, e.procName);
+}
+
+static size_t procBodySize(IrProc& p)
+{
+	IrEmitter e(true);
+	emitList(e, p.body, BLK_PROC, p.fallthrough.empty());
+	return e.pos;
+}
+
+static size_t procExtent(IrProc& p)
+{
+	size_t size = procBodySize(p);
+	if (!p.fallthrough.empty())
+		size += procExtent(irProcTable[p.fallthrough]);
+	return size;
+}
+
+static int emitProgram(const std::vector<IrProc*>& layout)
+{
+	IrEmitter e(false);
+	BUF.clear();
+	g_sourceLocTable.clear();
+
+	for (size_t i = 0; i < layout.size(); i ++)
+	{
+		IrProc* p = layout[i];
+		p->pos = e.pos;
+		e.procName = p->name.c_str();
+		emitList(e, p->body, BLK_PROC, p->fallthrough.empty());
+	}
+
+	// Procedures extend up to the end of their fall-through chain
+	for (size_t i = layout.size(); i --; )
+	{
+		IrProc* p = layout[i];
+		size_t end = i+1 < layout.size() ? layout[i+1]->pos : e.pos;
+		p->size = end - p->pos;
+		if (!p->fallthrough.empty())
+			p->size += irProcTable[p->fallthrough].size;
+	}
+
+	g_procTable.clear();
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		g_procTable.insert( std::pair<std::string, procedure>(it->first, procedure(it->second.pos, it->second.size)) );
+
+	g_procRelocTable = e.relocs;
+
+	for (size_t i = 0; i < e.jumpFixups.size(); i ++)
+		BUF[e.jumpFixups[i].first] |= e.labelPos[e.jumpFixups[i].second] << 10;
+
+	// Rebuild the operand descriptor table, MAD first since it can only
+	// address the first 32 entries
+	g_opdescCount = 0;
+	g_opdescIsMad = 0;
+	for (int pass = 0; pass < 2; pass ++)
+		for (size_t i = 0; i < e.insnFixups.size(); i ++)
+		{
+			IrInsnFixup& f = e.insnFixups[i];
+			if ((f.insn.opcode == MAESTRO_MAD) == (pass == 0))
+				safe_call(encodeInsn(f.insn, BUF[f.pos], f.verbatim, f.loc));
+		}
+
+	return 0;
+}
+
+// --------------------------------------------------------------------
+// Tail calls and procedure layout
+// --------------------------------------------------------------------
+
+static bool procOrderLess(const IrProc* a, const IrProc* b)
+{
+	return a->order < b->order;
+}
+
+static void findCallers(IrList& list, const std::string& caller, std::map<std::string, std::vector<std::string> >& callers)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->type == IR_CALL)
+		{
+			std::vector<std::string>& v = callers[it->target];
+			if (std::find(v.begin(), v.end(), caller) == v.end())
+				v.push_back(caller);
+		}
+		findCallers(it->body, caller, callers);
+		findCallers(it->elseBody, caller, callers);
+	}
+}
+
+static void findCallees(IrList& list, std::vector<std::string>& callees)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->type == IR_CALL && std::find(callees.begin(), callees.end(), it->target) == callees.end())
+			callees.push_back(it->target);
+		findCallees(it->body, callees);
+		findCallees(it->elseBody, callees);
+	}
+}
+
+static bool chainContains(const std::string& head, const std::string& name)
+{
+	for (std::string cur = head; !cur.empty(); cur = irProcTable[cur].fallthrough)
+		if (cur == name)
+			return true;
+	return false;
+}
+
+// A procedure ending in an unconditional call can instead fall through into
+// the callee if the latter is placed right after it. Returns from PICA200
+// procedures are triggered by reaching the end address of the call, so the
+// callers of the procedure get their call size extended to cover the callee.
+static void optimizeTailCalls(void)
+{
+	std::vector<IrProc*> procs;
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		procs.push_back(&it->second);
+	std::sort(procs.begin(), procs.end(), procOrderLess);
+
+	std::map<std::string, bool> claimed;
+	for (size_t i = 0; i < procs.size(); i ++)
+	{
+		IrProc& p = *procs[i];
+		if (p.isEntry || p.body.empty())
+			continue;
+
+		IrNode& last = p.body.back();
+		if (last.type != IR_CALL || last.opcode() != MAESTRO_CALL)
+			continue;
+
+		std::string target = last.target;
+		if (claimed[target] || chainContains(target, p.name))
+			continue;
+
+		IrNode call = last;
+		p.body.pop_back();
+		p.fallthrough = target;
+
+		// The call size field is 8 bits wide, so check every chain that now gets longer
+		bool fits = true;
+		for (size_t j = 0; fits && j < procs.size(); j ++)
+			if (chainContains(procs[j]->name, p.name) && procExtent(*procs[j]) > 0xFF)
+				fits = false;
+
+		if (!fits)
+		{
+			p.body.push_back(call);
+			p.fallthrough.clear();
+			continue;
+		}
+
+		claimed[target] = true;
+		optNote("tail call from '%s' to '%s' turned into a fall-through\n", p.name.c_str(), target.c_str());
+	}
+}
+
+static void placeProc(IrProc& p, std::vector<IrProc*>& layout, std::map<std::string, bool>& placed,
+	std::map<std::string, std::vector<std::string> >& callers, std::map<std::string, bool>& isFallthrough)
+{
+	std::vector<std::string> chain;
+	for (std::string cur = p.name; !cur.empty(); cur = irProcTable[cur].fallthrough)
+	{
+		layout.push_back(&irProcTable[cur]);
+		placed[cur] = true;
+		chain.push_back(cur);
+	}
+
+	// Procedures with a single caller go right after it
+	for (size_t i = 0; i < chain.size(); i ++)
+	{
+		std::vector<std::string> callees;
+		findCallees(irProcTable[chain[i]].body, callees);
+		for (size_t j = 0; j < callees.size(); j ++)
+		{
+			const std::string& c = callees[j];
+			if (placed[c] || isFallthrough[c] || callers[c].size() != 1)
+				continue;
+			placeProc(irProcTable[c], layout, placed, callers, isFallthrough);
+		}
+	}
+}
+
+// Code shared by several DVLEs goes between the code of each of them, so that
+// the code reachable from every DVLE stays as contiguous as possible
+static bool procLayoutLess(const IrProc* a, const IrProc* b)
+{
+	int fa = a->dvles.empty() ? -1 : a->dvles.front(), la = a->dvles.empty() ? -1 : a->dvles.back();
+	int fb = b->dvles.empty() ? -1 : b->dvles.front(), lb = b->dvles.empty() ? -1 : b->dvles.back();
+	if (fa+la != fb+lb)
+		return fa+la < fb+lb;
+	if (fa != fb)
+		return fa < fb;
+	return a->order < b->order;
+}
+
+static void findReachable(void);
+
+static void layoutProgram(std::vector<IrProc*>& layout)
+{
+	std::vector<IrProc*> procs;
+	std::map<std::string, std::vector<std::string> > callers;
+	std::map<std::string, bool> placed, isFallthrough;
+
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+	{
+		procs.push_back(&it->second);
+		findCallers(it->second.body, it->first, callers);
+		if (!it->second.fallthrough.empty())
+			isFallthrough[it->second.fallthrough] = true;
+	}
+	findReachable();
+	std::sort(procs.begin(), procs.end(), procLayoutLess);
+
+	for (size_t i = 0; i < procs.size(); i ++)
+		if (!placed[procs[i]->name] && !isFallthrough[procs[i]->name])
+			placeProc(*procs[i], layout, placed, callers, isFallthrough);
+}
+
+// --------------------------------------------------------------------
+// Reachability
+// --------------------------------------------------------------------
+
+static void markReachable(const std::string& name, int dvle, std::map<std::string, bool>& visited)
+{
+	if (visited[name])
+		return;
+	visited[name] = true;
+
+	IrProc& p = irProcTable[name];
+	p.dvles.push_back(dvle);
+
+	std::vector<std::string> callees;
+	findCallees(p.body, callees);
+	if (!p.fallthrough.empty())
+		callees.push_back(p.fallthrough);
+	for (size_t i = 0; i < callees.size(); i ++)
+		markReachable(callees[i], dvle, visited);
+}
+
+static void findReachable(void)
+{
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		it->second.dvles.clear();
+
+	for (size_t i = 0; i < irDvles.size(); i ++)
+	{
+		std::map<std::string, bool> visited;
+		if (irProcTable.find(irDvles[i]->entrypoint) != irProcTable.end())
+			markReachable(irDvles[i]->entrypoint, i, visited);
+	}
+}
+
+// Procedures not reachable from any DVLE entrypoint are removed
+static void stripDeadProcs(void)
+{
+	findReachable();
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); )
+	{
+		if (!it->second.dvles.empty())
+		{
+			++it;
+			continue;
+		}
+		optNote("procedure '%s' is unreachable, removed (%u instructions)\n", it->first.c_str(), (unsigned)procBodySize(it->second));
+		irProcTable.erase(it++);
+	}
+}
+
+// --------------------------------------------------------------------
+// Procedure deduplication
+// --------------------------------------------------------------------
+
+static inline u32 hashWord(u32 h, u32 v)
+{
+	return (h ^ v) * 16777619U; // FNV-1a
+}
+
+static bool sameInsn(const IrInsn& a, const IrInsn& b)
+{
+	if (a.opcode != b.opcode || a.dest != b.dest || a.mask != b.mask)
+		return false;
+	if (a.opcode == MAESTRO_CMP && (a.cmpx != b.cmpx || a.cmpy != b.cmpy))
+		return false;
+	for (int i = 0; i < irSrcCount(a.opcode); i ++)
+		if (a.src[i] != b.src[i] || a.srcSw[i] != b.srcSw[i] || a.idx[i] != b.idx[i])
+			return false;
+	return true;
+}
+
+// Label ids are left out, so that they do not need to match
+static u32 hashList(const IrList& list, u32 h)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		h = hashWord(h, it->type);
+		h = hashWord(h, it->word);
+		if (it->hasOperands())
+		{
+			const IrInsn& in = it->insn;
+			h = hashWord(h, in.dest | (in.mask << 8));
+			for (int i = 0; i < irSrcCount(in.opcode); i ++)
+				h = hashWord(h, in.src[i] | (in.srcSw[i] << 8) | (in.idx[i] << 20));
+		}
+		for (size_t i = 0; i < it->target.size(); i ++)
+			h = hashWord(h, (u8)it->target[i]);
+		h = hashList(it->body, h);
+		h = hashList(it->elseBody, hashWord(h, 0xE15E));
+	}
+	return h;
+}
+
+// Procedures are equivalent if they only differ in the ids of their labels
+static bool equivList(const IrList& a, const IrList& b, std::map<int, int>& labels)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i ++)
+	{
+		const IrNode& x = a[i];
+		const IrNode& y = b[i];
+		if (x.type != y.type || x.word != y.word || x.target != y.target)
+			return false;
+		if (x.hasOperands() && !sameInsn(x.insn, y.insn))
+			return false;
+		if (x.type == IR_LABEL || x.type == IR_JUMP)
+		{
+			std::map<int, int>::iterator it = labels.find(x.label);
+			if (it == labels.end())
+				labels[x.label] = y.label;
+			else if (it->second != y.label)
+				return false;
+		}
+		if (!equivList(x.body, y.body, labels) || !equivList(x.elseBody, y.elseBody, labels))
+			return false;
+	}
+	return true;
+}
+
+static void renameCalls(IrList& list, const std::string& from, const std::string& to)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->type == IR_CALL && it->target == from)
+			it->target = to;
+		renameCalls(it->body, from, to);
+		renameCalls(it->elseBody, from, to);
+	}
+}
+
+// Procedures with identical code are merged into the first one. Callers of
+// duplicates becoming identical are merged in turn.
+static void mergeIdenticalProcs(void)
+{
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+
+		std::vector<IrProc*> procs;
+		for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+			procs.push_back(&it->second);
+		std::sort(procs.begin(), procs.end(), procOrderLess);
+
+		std::map<u32, std::vector<IrProc*> > buckets;
+		for (size_t i = 0; !changed && i < procs.size(); i ++)
+		{
+			IrProc& dup = *procs[i];
+			std::vector<IrProc*>& bucket = buckets[hashList(dup.body, 2166136261U)];
+			for (size_t j = 0; !changed && j < bucket.size(); j ++)
+			{
+				IrProc& keep = *bucket[j];
+				std::map<int, int> labels;
+				if (!equivList(keep.body, dup.body, labels))
+					continue;
+
+				optNote("procedure '%s' is identical to '%s', merged (%u instructions)\n",
+					dup.name.c_str(), keep.name.c_str(), (unsigned)procBodySize(dup));
+				for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+					renameCalls(it->second.body, dup.name, keep.name);
+				for (size_t d = 0; d < irDvles.size(); d ++)
+					if (irDvles[d]->entrypoint == dup.name)
+						irDvles[d]->entrypoint = keep.name;
+				keep.isEntry = keep.isEntry || dup.isEntry;
+				irProcTable.erase(dup.name);
+				changed = true;
+			}
+			if (!changed)
+				bucket.push_back(&dup);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+// Inlining
+// --------------------------------------------------------------------
+
+// Procedures up to this size are inlined at -O3 even if it grows the program
+#define INLINE_MAX_SIZE 8
+
+static size_t programSize(void)
+{
+	size_t size = 0;
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		size += procBodySize(it->second);
+	return size;
+}
+
+static size_t codeBudget(void)
+{
+	for (dvleTableIter it = g_dvleTable.begin(); it != g_dvleTable.end(); ++it)
+		if (!it->nodvle && !it->isGeoShader)
+			return MAX_VSH_SIZE;
+	return MAX_GSH_SIZE;
+}
+
+// A break outside of a FOR block within the procedure affects the caller's loop
+static bool hasLooseBreak(const IrList& list)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->isOp(MAESTRO_BREAK) || it->isOp(MAESTRO_BREAKC))
+			return true;
+		if (it->type == IR_IF && (hasLooseBreak(it->body) || hasLooseBreak(it->elseBody)))
+			return true;
+	}
+	return false;
+}
+
+// Jumping to the end of a procedure returns from it, which is not the same
+// as jumping to the end of the enclosing block once inlined
+static bool hasEndJump(const IrList& list)
+{
+	IrList::const_reverse_iterator it;
+	for (it = list.rbegin(); it != list.rend() && it->type == IR_LABEL; ++it);
+	return it != list.rbegin();
+}
+
+static void countCalls(const IrList& list, const std::string& target, int& uncond, int& cond)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->type == IR_CALL && it->target == target)
+			(it->opcode() == MAESTRO_CALL ? uncond : cond) ++;
+		countCalls(it->body, target, uncond, cond);
+		countCalls(it->elseBody, target, uncond, cond);
+	}
+}
+
+static void remapLabels(IrList& list, std::map<int, int>& remap)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->type == IR_LABEL || it->type == IR_JUMP)
+		{
+			std::map<int, int>::iterator r = remap.find(it->label);
+			if (r == remap.end())
+				r = remap.insert(std::make_pair(it->label, irLabelCount++)).first;
+			it->label = r->second;
+		}
+		remapLabels(it->body, remap);
+		remapLabels(it->elseBody, remap);
+	}
+}
+
+static int inlineCalls(IrList& list, const IrProc& callee)
+{
+	int count = 0;
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		IrNode& n = list[i];
+		if (n.type != IR_CALL || n.opcode() != MAESTRO_CALL || n.target != callee.name)
+		{
+			count += inlineCalls(n.body, callee);
+			count += inlineCalls(n.elseBody, callee);
+			continue;
+		}
+
+		IrList copy = callee.body;
+		std::map<int, int> remap;
+		remapLabels(copy, remap);
+		list.erase(list.begin() + i);
+		list.insert(list.begin() + i, copy.begin(), copy.end());
+		i += copy.size() - 1;
+		count ++;
+	}
+	return count;
+}
+
+static bool callSizesFit(void)
+{
+	std::map<std::string, std::vector<std::string> > callers;
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		findCallers(it->second.body, it->first, callers);
+
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		if (callers.find(it->first) != callers.end() && procBodySize(it->second) > 0xFF)
+			return false;
+	return true;
+}
+
+// Unconditional calls to leaf procedures are replaced by a copy of the body.
+// Procedures with a single call site are always inlined (the procedure then
+// goes away), at -O3 small procedures are inlined everywhere as long as the
+// program still fits in code memory.
+static void inlineProcs(void)
+{
+	size_t budget = codeBudget();
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+
+		std::vector<IrProc*> procs;
+		for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+			procs.push_back(&it->second);
+		std::sort(procs.begin(), procs.end(), procOrderLess);
+
+		std::vector<std::string> names;
+		for (size_t i = 0; i < procs.size(); i ++)
+			names.push_back(procs[i]->name);
+
+		// The table may get restored below, so look procedures up by name
+		for (size_t i = 0; !changed && i < names.size(); i ++)
+		{
+			IrProc& callee = irProcTable[names[i]];
+			std::vector<std::string> callees;
+			findCallees(callee.body, callees);
+			if (!callees.empty() || hasLooseBreak(callee.body) || hasEndJump(callee.body))
+				continue;
+
+			int uncond = 0, cond = 0;
+			for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+				countCalls(it->second.body, callee.name, uncond, cond);
+			if (!uncond)
+				continue;
+
+			bool removable = !cond && !callee.isEntry;
+			size_t calleeSize = procBodySize(callee);
+			if (!(uncond == 1 && removable) && (g_optLevel < 3 || calleeSize > INLINE_MAX_SIZE))
+				continue;
+
+			size_t oldSize = programSize();
+			irProcTableType saved = irProcTable;
+			std::string name = callee.name;
+
+			for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+				if (it->first != name)
+					inlineCalls(it->second.body, callee);
+			if (removable)
+				irProcTable.erase(name);
+
+			size_t newSize = programSize();
+			if ((newSize > oldSize && newSize > budget) || !callSizesFit())
+			{
+				irProcTable = saved;
+				optNote("procedure '%s' not inlined: code size limit reached\n", name.c_str());
+				continue;
+			}
+
+			optNote("inlined '%s' into %d call site%s: %+d instructions, %d fewer call%s executed\n", name.c_str(),
+				uncond, uncond == 1 ? "" : "s", (int)newSize - (int)oldSize, uncond, uncond == 1 ? "" : "s");
+			changed = true;
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+// Variant specialization
+// --------------------------------------------------------------------
+
+// Returns the value of a bool uniform fixed by a variant, or -1
+static int fixedBool(const DVLEData* dvle, int reg)
+{
+	if (!(dvle->fixedBools & BIT(reg)))
+		return -1;
+	for (int i = 0; i < dvle->constantCount; i ++)
+		if (dvle->constantTable[i].type == UTYPE_BOOL && dvle->constantTable[i].regId == 0x88+reg)
+			return dvle->constantTable[i].bparam ? 1 : 0;
+	return -1;
+}
+
+static bool hasLabel(const IrList& list)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+		if (it->type == IR_LABEL || hasLabel(it->body) || hasLabel(it->elseBody))
+			return true;
+	return false;
+}
+
+// Clones start as copies of the original, so nodes can be compared bitwise
+static bool sameList(const IrList& a, const IrList& b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i ++)
+	{
+		const IrNode& x = a[i];
+		const IrNode& y = b[i];
+		if (x.type != y.type || x.word != y.word || x.label != y.label || x.target != y.target)
+			return false;
+		if (x.hasOperands() && memcmp(&x.insn, &y.insn, sizeof(IrInsn)) != 0)
+			return false;
+		if (!sameList(x.body, y.body) || !sameList(x.elseBody, y.elseBody))
+			return false;
+	}
+	return true;
+}
+
+// Resolves the ifu/callu/jmpu instructions testing fixed bool uniforms
+static int specializeList(IrList& list, const DVLEData* dvle, const std::string& suffix)
+{
+	int count = 0;
+	size_t i = 0;
+	while (i < list.size())
+	{
+		IrNode& n = list[i];
+		count += specializeList(n.body, dvle, suffix);
+		count += specializeList(n.elseBody, dvle, suffix);
+		if (n.type == IR_CALL)
+			n.target += suffix;
+
+		int op = n.opcode(), b = -1;
+		if ((n.type == IR_IF && op == MAESTRO_IFU) || (n.type == IR_CALL && op == MAESTRO_CALLU) || (n.type == IR_JUMP && op == MAESTRO_JMPU))
+			b = fixedBool(dvle, (n.word>>22) & 0xF);
+		if (b < 0)
+		{
+			i ++;
+			continue;
+		}
+
+		if (n.type == IR_IF)
+		{
+			if (hasLabel(b ? n.elseBody : n.body))
+			{
+				i ++;
+				continue;
+			}
+			IrList taken;
+			taken.swap(b ? n.body : n.elseBody);
+			list.erase(list.begin() + i);
+			list.insert(list.begin() + i, taken.begin(), taken.end());
+			i += taken.size();
+		} else if (n.type == IR_CALL && b)
+		{
+			n.word = FMT_OPCODE(MAESTRO_CALL);
+			i ++;
+		} else if (n.type == IR_JUMP && b != (int)(n.word & 1))
+		{
+			// Always taken: the code skipped up to the label goes away, or
+			// else the jump stays since the bool uniform holds the right value
+			size_t k;
+			for (k = i+1; k < list.size() && !(list[k].type == IR_LABEL && list[k].label == n.label); k ++);
+			IrList skipped(list.begin() + i+1, list.begin() + (k < list.size() ? k : i+1));
+			if (k < list.size() && !hasLabel(skipped))
+				list.erase(list.begin() + i, list.begin() + k);
+			else
+				i ++;
+		} else
+			list.erase(list.begin() + i);
+		count ++;
+	}
+	return count;
+}
+
+// Finds a procedure a clone can be merged into: either the original one, or
+// an identical clone made for another variant
+static std::string findIdentical(const IrProc& clone, const std::string& orig, const std::map<std::string, std::string>& clones)
+{
+	if (sameList(clone.body, irProcTable[orig].body))
+		return orig;
+	for (std::map<std::string, std::string>::const_iterator it = clones.begin(); it != clones.end(); ++it)
+	{
+		irProcTableIter other = irProcTable.find(it->first);
+		if (it->second == orig && other != irProcTable.end() && sameList(clone.body, other->second.body))
+			return it->first;
+	}
+	return "";
+}
+
+// The code reachable from a variant DVLE gets cloned and specialized on its
+// fixed bool uniforms. Clones which end up identical to the original
+// procedure or to the clone made for another variant are merged into it, so
+// that code stays shared as much as possible.
+static void specializeVariants(void)
+{
+	std::map<std::string, std::string> clones; // Clone -> original procedure
+
+	for (size_t d = 0; d < irDvles.size(); d ++)
+	{
+		DVLEData* dvle = irDvles[d];
+		if (!dvle->fixedBools || irProcTable.find(dvle->entrypoint) == irProcTable.end())
+			continue;
+
+		std::string suffix = "$" + dvle->variantName;
+		irProcTableType saved = irProcTable;
+		size_t oldSize = programSize();
+
+		std::vector<std::string> names;
+		names.push_back(dvle->entrypoint);
+		for (size_t i = 0; i < names.size(); i ++)
+			findCallees(irProcTable[names[i]].body, names);
+
+		int count = 0;
+		for (size_t i = 0; i < names.size(); i ++)
+		{
+			IrProc p = irProcTable[names[i]];
+			p.name += suffix;
+			p.isEntry = i == 0;
+			count += specializeList(p.body, dvle, suffix);
+			irProcTable[p.name] = p;
+		}
+
+		// Merge clones until nothing changes, callees first becoming
+		// identical makes their callers identical too
+		std::string entry = names[0] + suffix;
+		int shared = 0;
+		bool changed = true;
+		while (changed)
+		{
+			changed = false;
+			for (size_t i = 0; i < names.size(); i ++)
+			{
+				std::string clone = names[i] + suffix;
+				irProcTableIter it = irProcTable.find(clone);
+				if (it == irProcTable.end())
+					continue;
+				std::string target = findIdentical(it->second, names[i], clones);
+				if (target.empty())
+					continue;
+
+				irProcTable.erase(it);
+				for (size_t j = 0; j < names.size(); j ++)
+				{
+					irProcTableIter c = irProcTable.find(names[j] + suffix);
+					if (c != irProcTable.end())
+						renameCalls(c->second.body, clone, target);
+				}
+				if (i == 0)
+					entry = target;
+				shared ++;
+				changed = true;
+			}
+		}
+
+		// Clones no longer called after specialization go away
+		std::vector<std::string> reached(1, entry);
+		for (size_t i = 0; i < reached.size(); i ++)
+			findCallees(irProcTable[reached[i]].body, reached);
+		for (size_t i = 0; i < names.size(); i ++)
+			if (std::find(reached.begin(), reached.end(), names[i] + suffix) == reached.end())
+				irProcTable.erase(names[i] + suffix);
+
+		if (entry == names[0])
+		{
+			optNote("variant '%s': no code to specialize\n", dvle->variantName.c_str());
+			continue;
+		}
+
+		size_t newSize = programSize();
+		if (newSize > oldSize && newSize > codeBudget())
+		{
+			irProcTable = saved;
+			optNote("variant '%s' not specialized: code size limit reached\n", dvle->variantName.c_str());
+			continue;
+		}
+
+		int specialized = 0;
+		for (size_t i = 0; i < names.size(); i ++)
+			if (irProcTable.find(names[i] + suffix) != irProcTable.end())
+			{
+				clones[names[i] + suffix] = names[i];
+				specialized ++;
+			}
+
+		dvle->entrypoint = entry;
+		optNote("variant '%s': %d branch%s resolved, %d procedure%s specialized, %d shared: %+d instructions\n",
+			dvle->variantName.c_str(), count, count == 1 ? "" : "es", specialized, specialized == 1 ? "" : "s",
+			shared, (int)newSize - (int)oldSize);
+	}
+
+	// Clones were compared including their labels, which must now become unique
+	for (std::map<std::string, std::string>::iterator it = clones.begin(); it != clones.end(); ++it)
+	{
+		std::map<int, int> remap;
+		remapLabels(irProcTable[it->first].body, remap);
+	}
+}
+
+// --------------------------------------------------------------------
+// Loop unrolling
+// --------------------------------------------------------------------
+
+// Largest size of a fully unrolled loop
+#define UNROLL_MAX_SIZE 64
+
+// Returns the value of an integer uniform register, which must hold the
+// same constant in every DVLE reaching the code (not a .seti default)
+static bool intConst(int reg, const std::vector<int>& dvles, u8* value)
+{
+	if (dvles.empty())
+		return false;
+
+	for (size_t i = 0; i < dvles.size(); i ++)
+	{
+		DVLEData* dvle = irDvles[dvles[i]];
+		const Constant* ct = NULL;
+		for (int j = 0; !ct && j < dvle->constantCount; j ++)
+			if (dvle->constantTable[j].type == UTYPE_IVEC && dvle->constantTable[j].fixed && dvle->constantTable[j].regId == reg)
+				ct = &dvle->constantTable[j];
+		if (!ct)
+			return false;
+		if (!i)
+			memcpy(value, ct->iparam, 4);
+		else if (memcmp(value, ct->iparam, 4) != 0)
+			return false;
+	}
+	return true;
+}
+
+static bool hasNestedCode(const IrList& list)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+		if (it->type == IR_CALL || it->type == IR_FOR || hasNestedCode(it->body) || hasNestedCode(it->elseBody))
+			return true;
+	return false;
+}
+
+static bool hasFlowControl(const IrList& list)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		switch (it->type)
+		{
+			case IR_CALL:
+			case IR_JUMP:
+			case IR_LABEL:
+			case IR_FOR:
+				return true;
+			case IR_IF:
+				if (hasFlowControl(it->body) || hasFlowControl(it->elseBody))
+					return true;
+				break;
+		}
+		if (it->isOp(MAESTRO_BREAK) || it->isOp(MAESTRO_BREAKC))
+			return true;
+	}
+	return false;
+}
+
+static bool usesLoopCounter(const IrInsn& in)
+{
+	for (int i = 0; i < irSrcCount(in.opcode); i ++)
+		if (in.idx[i] == 3)
+			return true;
+	return false;
+}
+
+// Removing a loop also removes its updates of aL, so this is only done if
+// aL is never read outside of a loop that sets it itself
+static bool loopCounterConfined(const IrList& list, bool inLeafLoop)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->hasOperands() && !inLeafLoop && usesLoopCounter(it->insn))
+			return false;
+		bool leaf = it->type == IR_FOR ? !hasNestedCode(it->body) : inLeafLoop;
+		if (!loopCounterConfined(it->body, leaf) || !loopCounterConfined(it->elseBody, leaf))
+			return false;
+	}
+	return true;
+}
+
+static bool rewriteLoopCounter(IrList& list, int value)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->hasOperands())
+			for (int i = 0; i < irSrcCount(it->insn.opcode); i ++)
+			{
+				IrInsn& in = it->insn;
+				if (in.idx[i] != 3)
+					continue;
+				in.src[i] += value;
+				in.idx[i] = 0;
+				if (in.src[i] < 0x20 || in.src[i] >= 0x80)
+					return false;
+			}
+		if (!rewriteLoopCounter(it->body, value) || !rewriteLoopCounter(it->elseBody, value))
+			return false;
+	}
+	return true;
+}
+
+static size_t listSize(IrList& list, int kind, bool pad)
+{
+	IrEmitter e(true);
+	emitList(e, list, kind, pad);
+	return e.pos;
+}
+
+// FOR blocks whose integer register is a known constant are replaced by a
+// copy of the body per iteration, with aL-relative operands made absolute
+static void unrollList(IrList& list, IrProc& p, size_t budget)
+{
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		unrollList(list[i].body, p, budget);
+		unrollList(list[i].elseBody, p, budget);
+
+		u8 v[4];
+		IrNode& n = list[i];
+		if (n.type != IR_FOR || hasFlowControl(n.body) || !intConst(0x80 + ((n.word>>22) & 3), p.dvles, v))
+			continue;
+
+		int count = v[0]+1, start = v[1], step = v[2];
+		IrList unrolled;
+		bool ok = step < 0x80;
+		for (int k = 0; ok && k < count; k ++)
+		{
+			IrList copy = n.body;
+			ok = rewriteLoopCounter(copy, start + k*step);
+			unrolled.insert(unrolled.end(), copy.begin(), copy.end());
+		}
+		if (!ok || listSize(unrolled, BLK_PROC, false) > UNROLL_MAX_SIZE)
+			continue;
+
+		size_t oldSize = programSize(), oldExec = 1 + count*listSize(n.body, BLK_FOR, true);
+		IrNode loop = n;
+		list.erase(list.begin() + i);
+		list.insert(list.begin() + i, unrolled.begin(), unrolled.end());
+
+		size_t newSize = programSize();
+		if ((newSize > oldSize && newSize > budget) || !callSizesFit())
+		{
+			list.erase(list.begin() + i, list.begin() + i + unrolled.size());
+			list.insert(list.begin() + i, loop);
+			continue;
+		}
+
+		optNoteAt(loop.loc, "loop with %d iterations unrolled: %+d instructions, %d fewer executed\n",
+			count, (int)newSize - (int)oldSize, (int)oldExec - (int)listSize(unrolled, BLK_PROC, false));
+		i += unrolled.size() - 1;
+	}
+}
+
+static void unrollLoops(void)
+{
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		if (!loopCounterConfined(it->second.body, false))
+		{
+			optNote("loops not unrolled: aL is read outside of the loop setting it in '%s'\n", it->first.c_str());
+			return;
+		}
+
+	findReachable();
+	size_t budget = codeBudget();
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		unrollList(it->second.body, it->second, budget);
+}
+
+// --------------------------------------------------------------------
+// Constant folding
+// --------------------------------------------------------------------
+
+struct FoldState
+{
+	int known[16];       // Known components of each temporary register (bit 3 = x)
+	float value[16][4];
+
+	FoldState() { forgetAll(); }
+	void forgetAll() { memset(known, 0, sizeof(known)); }
+	void forget(int reg, int mask)
+	{
+		if (reg >= 0x10 && reg < 0x20)
+			known[reg-0x10] &= ~mask;
+	}
+};
+
+// Constant added by the optimizer to a set of DVLEs
+struct LinkConst
+{
+	std::vector<int> dvles;
+	int reg;
+	int used; // Components in use (bit 3 = x)
+	float value[4];
+};
+
+static std::vector<LinkConst> irLinkConsts;
+
+static inline bool sameF24(float a, float b)
+{
+	return f32tof24(a) == f32tof24(b);
+}
+
+// Only values f24 represents exactly are accepted, so that folded results
+// are the same the hardware computes
+static inline bool f24Exact(float& v)
+{
+	if (v != v || v - v != 0)
+		return false;
+	float r = f24tof32(f32tof24(v));
+	if (r != v)
+		return false;
+	v = r;
+	return true;
+}
+
+static inline bool writesTemp(const IrInsn& in)
+{
+	return in.opcode != MAESTRO_CMP && in.opcode != MAESTRO_MOVA && in.dest >= 0x10 && in.dest < 0x20;
+}
+
+// Returns the known components of a float uniform register, which must hold
+// the same constant in every DVLE reaching the code. Defaults set with .setf
+// can be overwritten by the application, so only constants count.
+static int uniformConst(int reg, const std::vector<int>& dvles, float* value)
+{
+	int known = dvles.empty() ? 0 : 0xF;
+	for (size_t i = 0; known && i < dvles.size(); i ++)
+	{
+		DVLEData* dvle = irDvles[dvles[i]];
+		const Constant* ct = NULL;
+		for (int j = 0; !ct && j < dvle->constantCount; j ++)
+			if (dvle->constantTable[j].type == UTYPE_FVEC && dvle->constantTable[j].fixed && dvle->constantTable[j].regId == reg)
+				ct = &dvle->constantTable[j];
+		if (!ct)
+			return 0;
+
+		for (int c = 0; c < 4; c ++)
+		{
+			float v = f24tof32(f32tof24(ct->fparam[c]));
+			if (!i)
+				value[c] = v;
+			else if (!sameF24(v, value[c]))
+				known &= ~(8>>c);
+		}
+	}
+	return known;
+}
+
+static int readSource(const IrInsn& in, int i, const FoldState& st, const std::vector<int>& dvles, float* out)
+{
+	int reg = in.src[i], known = 0;
+	float v[4];
+	if (in.idx[i] || reg < 0x10)
+		return 0;
+	if (reg < 0x20)
+	{
+		known = st.known[reg-0x10];
+		memcpy(v, st.value[reg-0x10], sizeof(v));
+	} else
+		known = uniformConst(reg, dvles, v);
+
+	int ret = 0, sw = in.srcSw[i];
+	for (int c = 0; c < 4; c ++)
+	{
+		int sel = (sw >> (7-2*c)) & 3;
+		if (known & (8>>sel))
+		{
+			out[c] = (sw & 1) ? -v[sel] : v[sel];
+			ret |= 8>>c;
+		}
+	}
+	return ret;
+}
+
+static bool evalInsn(const IrInsn& in, const FoldState& st, const std::vector<int>& dvles, float* out)
+{
+	int needs[3] = { in.mask, in.mask, in.mask };
+	switch (in.opcode)
+	{
+		case MAESTRO_DP3: needs[0] = needs[1] = 0xE; break;
+		case MAESTRO_DP4: needs[0] = needs[1] = 0xF; break;
+		case MAESTRO_DPH: needs[0] = 0xE; needs[1] = 0xF; break;
+		case MAESTRO_ADD:
+		case MAESTRO_MUL:
+		case MAESTRO_MAX:
+		case MAESTRO_MIN:
+		case MAESTRO_SGE:
+		case MAESTRO_SLT:
+		case MAESTRO_FLR:
+		case MAESTRO_MOV:
+		case MAESTRO_MAD:
+			break;
+		default:
+			return false;
+	}
+
+	float s[3][4];
+	for (int i = 0; i < irSrcCount(in.opcode); i ++)
+		if ((readSource(in, i, st, dvles, s[i]) & needs[i]) != needs[i])
+			return false;
+
+	if (in.opcode == MAESTRO_DP3 || in.opcode == MAESTRO_DP4 || in.opcode == MAESTRO_DPH)
+	{
+		float dot = 0.0f;
+		for (int c = 0; c < (in.opcode == MAESTRO_DP3 ? 3 : 4); c ++)
+		{
+			float m = (in.opcode == MAESTRO_DPH && c == 3) ? s[1][3] : s[0][c]*s[1][c];
+			dot += m;
+			if (!f24Exact(m) || !f24Exact(dot))
+				return false;
+		}
+		for (int c = 0; c < 4; c ++)
+			out[c] = dot;
+		return true;
+	}
+
+	for (int c = 0; c < 4; c ++)
+	{
+		if (!(in.mask & (8>>c)))
+			continue;
+		float a = s[0][c], b = s[1][c], r = 0.0f;
+		switch (in.opcode)
+		{
+			case MAESTRO_ADD: r = a + b; break;
+			case MAESTRO_MUL: r = a * b; break;
+			case MAESTRO_MAX: r = a > b ? a : b; break;
+			case MAESTRO_MIN: r = a < b ? a : b; break;
+			case MAESTRO_SGE: r = a >= b ? 1.0f : 0.0f; break;
+			case MAESTRO_SLT: r = a < b ? 1.0f : 0.0f; break;
+			case MAESTRO_FLR: r = floorf(a); break;
+			case MAESTRO_MOV: r = a; break;
+			case MAESTRO_MAD:
+				r = a * b;
+				if (!f24Exact(r))
+					return false;
+				r += s[2][c];
+				break;
+		}
+		if (!f24Exact(r))
+			return false;
+		out[c] = r;
+	}
+	return true;
+}
+
+// Builds a swizzle reading the wanted components from a constant
+static bool matchConst(const float* v, int mask, const float* cv, int cknown, int& sw)
+{
+	sw = 0;
+	for (int c = 0; c < 4; c ++)
+	{
+		int sel = c;
+		if (mask & (8>>c))
+		{
+			for (sel = 0; sel < 4; sel ++)
+				if ((cknown & (8>>sel)) && sameF24(v[c], cv[sel]))
+					break;
+			if (sel == 4)
+				return false;
+		}
+		sw |= SWIZZLE_COMP(c, sel);
+	}
+	return true;
+}
+
+static bool addToLinkConst(LinkConst& lc, const float* v, int mask)
+{
+	LinkConst tmp = lc;
+	for (int c = 0; c < 4; c ++)
+	{
+		int sw;
+		if (!(mask & (8>>c)) || matchConst(&v[c], 8, tmp.value, tmp.used, sw))
+			continue;
+		int k;
+		for (k = 0; k < 4 && (tmp.used & (8>>k)); k ++);
+		if (k == 4)
+			return false;
+		tmp.value[k] = v[c];
+		tmp.used |= 8>>k;
+	}
+	lc = tmp;
+	return true;
+}
+
+// Finds a constant register holding the given values in all the DVLEs,
+// reusing existing constants where possible
+static bool findConst(const float* v, int mask, const std::vector<int>& dvles, int& reg, int& sw)
+{
+	for (reg = 0x20; reg < 0x80; reg ++)
+	{
+		float cv[4];
+		int known = uniformConst(reg, dvles, cv);
+		if (known && matchConst(v, mask, cv, known, sw))
+			return true;
+	}
+
+	for (int pass = 0; pass < 2; pass ++)
+		for (size_t i = 0; i < irLinkConsts.size(); i ++)
+		{
+			LinkConst& lc = irLinkConsts[i];
+			if (!std::includes(lc.dvles.begin(), lc.dvles.end(), dvles.begin(), dvles.end()))
+				continue;
+			if (pass == 1 && !addToLinkConst(lc, v, mask))
+				continue;
+			if (matchConst(v, mask, lc.value, lc.used, sw))
+			{
+				reg = lc.reg;
+				return true;
+			}
+		}
+
+	std::vector<DVLEData*> targets;
+	for (size_t i = 0; i < dvles.size(); i ++)
+	{
+		DVLEData* dvle = irDvles[dvles[i]];
+		int count = dvle->constantCount;
+		for (size_t j = 0; j < irLinkConsts.size(); j ++)
+			if (std::binary_search(irLinkConsts[j].dvles.begin(), irLinkConsts[j].dvles.end(), dvles[i]))
+				count ++;
+		if (count >= MAX_CONSTANT)
+			return false;
+		targets.push_back(dvle);
+	}
+
+	LinkConst lc;
+	lc.dvles = dvles;
+	lc.used = 0;
+	memset(lc.value, 0, sizeof(lc.value));
+	if (!addToLinkConst(lc, v, mask) || (lc.reg = AllocLinkConstant(targets)) < 0)
+		return false;
+	irLinkConsts.push_back(lc);
+	reg = lc.reg;
+	return matchConst(v, mask, lc.value, lc.used, sw);
+}
+
+static void collectWrites(const IrList& list, int* written);
+
+static void collectNodeWrites(const IrNode& n, int* written)
+{
+	if (n.type == IR_CALL)
+		for (int i = 0; i < 16; i ++)
+			written[i] = 0xF;
+	else if (n.hasOperands() && writesTemp(n.insn))
+		written[n.insn.dest-0x10] |= n.insn.mask;
+	collectWrites(n.body, written);
+	collectWrites(n.elseBody, written);
+}
+
+static void collectWrites(const IrList& list, int* written)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+		collectNodeWrites(*it, written);
+}
+
+// Called for each instruction along with its result, if known
+typedef void (*KnownValueVisitor)(IrNode& n, const FoldState& st, IrProc& p, const float* result);
+
+// Walks the code keeping track of the known values of temporary registers
+static void propagateList(IrList& list, FoldState& st, IrProc& p, KnownValueVisitor visit)
+{
+	for (IrListIter it = list.begin(); it != list.end(); ++it)
+	{
+		switch (it->type)
+		{
+			case IR_INSN:
+			{
+				if (!it->hasOperands())
+					break;
+
+				// Rewrites done by the visitor do not change the result
+				float v[4];
+				IrInsn& in = it->insn;
+				bool known = in.opcode != MAESTRO_CMP && in.opcode != MAESTRO_MOVA && evalInsn(in, st, p.dvles, v);
+				visit(*it, st, p, known ? v : NULL);
+
+				if (!writesTemp(in))
+					break;
+				st.forget(in.dest, in.mask);
+				if (!known)
+					break;
+				for (int c = 0; c < 4; c ++)
+					if (in.mask & (8>>c))
+						st.value[in.dest-0x10][c] = v[c];
+				st.known[in.dest-0x10] |= in.mask;
+				break;
+			}
+
+			case IR_CALL:
+			case IR_LABEL:
+				st.forgetAll();
+				break;
+
+			case IR_IF:
+			{
+				FoldState other = st;
+				propagateList(it->body, st, p, visit);
+				propagateList(it->elseBody, other, p, visit);
+				for (int i = 0; i < 16; i ++)
+					for (int c = 0; c < 4; c ++)
+						if (!(other.known[i] & (8>>c)) || !sameF24(st.value[i][c], other.value[i][c]))
+							st.known[i] &= ~(8>>c);
+				break;
+			}
+
+			case IR_FOR:
+			{
+				int written[16] = { 0 };
+				collectWrites(it->body, written);
+				for (int i = 0; i < 16; i ++)
+					st.known[i] &= ~written[i];
+				FoldState inner = st;
+				propagateList(it->body, inner, p, visit);
+				break;
+			}
+		}
+	}
+}
+
+static void propagateProgram(KnownValueVisitor visit)
+{
+	findReachable();
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+	{
+		FoldState st;
+		propagateList(it->second.body, st, it->second, visit);
+	}
+}
+
+static void setInsn(IrNode& n, const IrInsn& in)
+{
+	n.insn = in;
+	n.word = FMT_OPCODE(in.opcode);
+}
+
+static void foldInsn(IrNode& n, const FoldState&, IrProc& p, const float* result)
+{
+	int reg, sw;
+	if (!result || n.insn.opcode == MAESTRO_MOV || !findConst(result, n.insn.mask, p.dvles, reg, sw))
+		return;
+
+	IrInsn in;
+	memset(&in, 0, sizeof(in));
+	in.opcode = MAESTRO_MOV;
+	in.dest = n.insn.dest;
+	in.mask = n.insn.mask;
+	in.src[0] = reg;
+	in.srcSw[0] = OPSRC_MAKE(0, sw);
+	setInsn(n, in);
+	optNoteAt(n.loc, "constant expression folded into c%d\n", reg-0x20);
+}
+
+// Instructions whose sources are all known constants are replaced by a MOV
+// from a constant holding the result. New constants are added to every DVLE
+// reaching the code.
+static void foldConstants(void)
+{
+	irLinkConsts.clear();
+	propagateProgram(foldInsn);
+
+	for (size_t i = 0; i < irLinkConsts.size(); i ++)
+	{
+		LinkConst& lc = irLinkConsts[i];
+		for (size_t j = 0; j < lc.dvles.size(); j ++)
+		{
+			DVLEData* dvle = irDvles[lc.dvles[j]];
+			Constant& ct = dvle->constantTable[dvle->constantCount++];
+			ct.regId = lc.reg;
+			ct.type = UTYPE_FVEC;
+			ct.fixed = true;
+			for (int c = 0; c < 4; c ++)
+				ct.fparam[c] = lc.value[c];
+		}
+		optNote("new constant c%d(%g, %g, %g, %g) added to %u DVLE%s\n", lc.reg-0x20,
+			lc.value[0], lc.value[1], lc.value[2], lc.value[3], (unsigned)lc.dvles.size(), lc.dvles.size() == 1 ? "" : "s");
+	}
+}
+
+// --------------------------------------------------------------------
+// Strength reduction
+// --------------------------------------------------------------------
+
+// Returns whether the given source holds the same known value in all the
+// components it reads
+static bool isSplat(const IrInsn& in, int i, const FoldState& st, const std::vector<int>& dvles, float value)
+{
+	float v[4];
+	int known = readSource(in, i, st, dvles, v);
+	if ((known & in.mask) != in.mask)
+		return false;
+	for (int c = 0; c < 4; c ++)
+		if ((in.mask & (8>>c)) && !sameF24(v[c], value))
+			return false;
+	return true;
+}
+
+static void reduceInsn(IrNode& n, const FoldState& st, IrProc& p, const float* result)
+{
+	if (result)
+		return; // Left to constant folding
+
+	const IrInsn& in = n.insn;
+	IrInsn out = in;
+	const char* what = NULL;
+
+	switch (in.opcode)
+	{
+		case MAESTRO_DP4:
+			// dp4 a, b with a.w = 1.0 is the same as dph a, b
+			for (int i = 0; !what && i < 2; i ++)
+			{
+				float v[4];
+				if (!(readSource(in, i, st, p.dvles, v) & 1) || !sameF24(v[3], 1.0f))
+					continue;
+				out = in;
+				out.opcode = MAESTRO_DPH;
+				if (i)
+					swapSources(out, 0, 1);
+				what = "dp4 with a w of 1.0 rewritten as dph";
+			}
+			break;
+
+		case MAESTRO_MUL:
+			for (int i = 0; !what && i < 2; i ++)
+			{
+				out = in;
+				if (i)
+					swapSources(out, 0, 1);
+				if (isSplat(in, i, st, p.dvles, 2.0f))
+				{
+					out.opcode = MAESTRO_ADD;
+					out.src[0] = out.src[1];
+					out.srcSw[0] = out.srcSw[1];
+					out.idx[0] = out.idx[1];
+					what = "multiplication by 2.0 rewritten as an addition";
+				} else if (isSplat(in, i, st, p.dvles, 1.0f) || isSplat(in, i, st, p.dvles, -1.0f))
+				{
+					bool neg = isSplat(in, i, st, p.dvles, -1.0f);
+					out.opcode = MAESTRO_MOV;
+					out.src[0] = out.src[1];
+					out.srcSw[0] = out.srcSw[1] ^ (neg ? 1 : 0);
+					out.idx[0] = out.idx[1];
+					out.src[1] = out.srcSw[1] = out.idx[1] = 0;
+					what = neg ? "multiplication by -1.0 rewritten as a negated move" : "multiplication by 1.0 rewritten as a move";
+				}
+			}
+			break;
+
+		case MAESTRO_MAD:
+			// mad a, 1.0, c is the same as add a, c
+			for (int i = 0; !what && i < 2; i ++)
+			{
+				if (!isSplat(in, i, st, p.dvles, 1.0f))
+					continue;
+				out = in;
+				out.opcode = MAESTRO_ADD;
+				out.src[0] = in.src[1-i];
+				out.srcSw[0] = in.srcSw[1-i];
+				out.idx[0] = in.idx[1-i];
+				out.src[1] = in.src[2];
+				out.srcSw[1] = in.srcSw[2];
+				out.idx[1] = in.idx[2];
+				out.src[2] = out.srcSw[2] = out.idx[2] = 0;
+				what = "multiply-add by 1.0 rewritten as an addition";
+			}
+			break;
+	}
+
+	IrInsn tmp = out;
+	if (!what || !legalizeInsn(tmp))
+		return;
+	setInsn(n, out);
+	optNoteAt(n.loc, "%s\n", what);
+}
+
+// Rewrites involving rcp or rsq are not done, since their results are
+// rounded and would no longer match the hardware
+static void reduceStrength(void)
+{
+	propagateProgram(reduceInsn);
+}
+
+// --------------------------------------------------------------------
+// Loop-invariant code motion
+// --------------------------------------------------------------------
+
+static bool listReads(const IrList& list, int reg, int mask);
+
+static bool nodeReads(const IrNode& n, int reg, int mask)
+{
+	if (n.type == IR_CALL)
+		return true;
+	if (n.hasOperands() && readsReg(n.insn, reg, mask))
+		return true;
+	return listReads(n.body, reg, mask) || listReads(n.elseBody, reg, mask);
+}
+
+static bool listReads(const IrList& list, int reg, int mask)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+		if (nodeReads(*it, reg, mask))
+			return true;
+	return false;
+}
+
+// Looks for instructions that may keep the code following them from running
+static bool hasExit(const IrNode& n)
+{
+	if (n.type == IR_JUMP || n.type == IR_LABEL || n.isOp(MAESTRO_BREAK) || n.isOp(MAESTRO_BREAKC) || n.isOp(MAESTRO_END))
+		return true;
+	for (size_t i = 0; i < n.body.size(); i ++)
+		if (hasExit(n.body[i]))
+			return true;
+	for (size_t i = 0; i < n.elseBody.size(); i ++)
+		if (hasExit(n.elseBody[i]))
+			return true;
+	return false;
+}
+
+static bool hasMova(const IrList& list)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+		if (it->isOp(MAESTRO_MOVA) || hasMova(it->body) || hasMova(it->elseBody))
+			return true;
+	return false;
+}
+
+// An instruction of a FOR body is invariant if nothing in the loop writes
+// its sources, nothing else writes its destination and nothing reads the
+// destination before it. It must also run at least once in every iteration.
+static bool isInvariant(const IrList& body, size_t i, bool movaInLoop)
+{
+	const IrNode& n = body[i];
+	if (!n.hasOperands() || !writesTemp(n.insn))
+		return false;
+
+	const IrInsn& in = n.insn;
+	int written[16] = { 0 };
+	for (size_t j = 0; j < body.size(); j ++)
+		if (j != i)
+			collectNodeWrites(body[j], written);
+	if (written[in.dest-0x10] & in.mask)
+		return false;
+
+	for (int s = 0; s < irSrcCount(in.opcode); s ++)
+	{
+		if (in.idx[s] == 3 || (in.idx[s] && movaInLoop))
+			return false;
+		if (in.src[s] == in.dest && (srcReads(in, s) & in.mask))
+			return false;
+		if (in.src[s] >= 0x10 && in.src[s] < 0x20 && (written[in.src[s]-0x10] & srcReads(in, s)))
+			return false;
+	}
+
+	for (size_t j = 0; j < i; j ++)
+		if (hasExit(body[j]) || nodeReads(body[j], in.dest, in.mask))
+			return false;
+	return true;
+}
+
+static void hoistList(IrList& list)
+{
+	for (size_t k = 0; k < list.size(); k ++)
+	{
+		hoistList(list[k].body);
+		hoistList(list[k].elseBody);
+
+		if (list[k].type == IR_FOR)
+		{
+			bool movaInLoop = hasMova(list[k].body);
+			size_t i = 0;
+			while (i < list[k].body.size())
+			{
+				if (!isInvariant(list[k].body, i, movaInLoop))
+				{
+					i ++;
+					continue;
+				}
+				IrNode n = list[k].body[i];
+				list[k].body.erase(list[k].body.begin() + i);
+				list.insert(list.begin() + k, n);
+				optNoteAt(n.loc, "loop-invariant instruction hoisted out of the loop\n");
+				k ++;
+				i = 0; // Hoisting may make earlier instructions invariant
+			}
+		} else if (list[k].type == IR_IF)
+		{
+			// Instructions at the start of both branches run anyway
+			while (!list[k].body.empty() && !list[k].elseBody.empty())
+			{
+				IrNode& a = list[k].body.front();
+				IrNode& b = list[k].elseBody.front();
+				if (!a.hasOperands() || !b.hasOperands() || a.insn.opcode == MAESTRO_CMP || a.word != b.word || memcmp(&a.insn, &b.insn, sizeof(IrInsn)) != 0)
+					break;
+				IrNode n = a;
+				list[k].body.erase(list[k].body.begin());
+				list[k].elseBody.erase(list[k].elseBody.begin());
+				list.insert(list.begin() + k, n);
+				optNoteAt(n.loc, "instruction common to both branches hoisted out of the IF block\n");
+				k ++;
+			}
+		}
+	}
+}
+
+static void hoistInvariants(void)
+{
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		hoistList(it->second.body);
+}
+
+// --------------------------------------------------------------------
+// Common subexpression elimination
+// --------------------------------------------------------------------
+
+// Value numbering tracks a version for every component written to a
+// register, and carries on into the blocks dominated by the code before them
+struct ValueState
+{
+	int ver[0x20][4];
+	int a0Ver, aLVer;
+	int counter;
+
+	ValueState() : a0Ver(0), aLVer(0), counter(0) { memset(ver, 0, sizeof(ver)); }
+
+	int get(int reg, int c) const { return reg < 0x20 ? ver[reg][c] : 0; }
+
+	void kill(int reg, int mask)
+	{
+		for (int c = 0; c < 4; c ++)
+			if (mask & (8>>c))
+				ver[reg][c] = ++counter;
+	}
+
+	void killAll(void)
+	{
+		for (int i = 0; i < 0x20; i ++)
+			kill(i, 0xF);
+		a0Ver = ++counter;
+		aLVer = ++counter;
+	}
+
+	// Joins the states at the end of both branches of an IF block
+	void merge(const ValueState& before, const ValueState& other)
+	{
+		counter = other.counter;
+		for (int i = 0; i < 0x20; i ++)
+			for (int c = 0; c < 4; c ++)
+				if (ver[i][c] != before.ver[i][c] || other.ver[i][c] != before.ver[i][c])
+					ver[i][c] = ++counter;
+		if (a0Ver != before.a0Ver || other.a0Ver != before.a0Ver)
+			a0Ver = ++counter;
+		if (aLVer != before.aLVer || other.aLVer != before.aLVer)
+			aLVer = ++counter;
+	}
+
+	void write(const IrInsn& in)
+	{
+		if (in.opcode == MAESTRO_MOVA)
+			a0Ver = ++counter;
+		else if (in.opcode != MAESTRO_CMP && in.dest < 0x20)
+			for (int c = 0; c < 4; c ++)
+				if (in.mask & (8>>c))
+					ver[in.dest][c] = ++counter;
+	}
+};
+
+struct AvailExpr
+{
+	IrList* list;      // Block and position of the instruction computing it
+	size_t pos;
+	int srcVer[3][4];  // Versions of the sources it was computed from
+	int a0Ver, aLVer;
+	int destVer[4];    // Versions of the destination holding the result
+};
+
+static inline bool isDot(int opcode)
+{
+	return opcode == MAESTRO_DP3 || opcode == MAESTRO_DP4 || opcode == MAESTRO_DPH;
+}
+
+static bool sameExpr(const IrInsn& a, const AvailExpr& e, const IrInsn& b, const ValueState& vs)
+{
+	if (a.opcode != b.opcode)
+		return false;
+	for (int i = 0; i < irSrcCount(a.opcode); i ++)
+	{
+		if (a.src[i] != b.src[i] || a.srcSw[i] != b.srcSw[i] || a.idx[i] != b.idx[i])
+			return false;
+		if ((a.idx[i] == 1 || a.idx[i] == 2) && e.a0Ver != vs.a0Ver)
+			return false;
+		if (a.idx[i] == 3 && e.aLVer != vs.aLVer)
+			return false;
+		for (int c = 0; c < 4; c ++)
+			if (e.srcVer[i][c] != vs.get(b.src[i], c))
+				return false;
+	}
+	return true;
+}
+
+// Temporary registers not used anywhere in the program
+static void findUnusedTemps(const IrList& list, bool* unused)
+{
+	for (IrList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->hasOperands())
+		{
+			const IrInsn& in = it->insn;
+			if (writesTemp(in))
+				unused[in.dest-0x10] = false;
+			for (int i = 0; i < irSrcCount(in.opcode); i ++)
+				if (in.src[i] >= 0x10 && in.src[i] < 0x20)
+					unused[in.src[i]-0x10] = false;
+		}
+		findUnusedTemps(it->body, unused);
+		findUnusedTemps(it->elseBody, unused);
+	}
+}
+
+// Once the destination of an earlier result gets overwritten, the result can
+// still be kept around by renaming it to an unused temporary register up to
+// the point where it was overwritten
+static bool renameResult(IrList& list, size_t pos, size_t end, bool* unused)
+{
+	IrInsn& r = list[pos].insn;
+	int reg = r.dest, mask = r.mask;
+	if (reg < 0x10)
+		return false;
+
+	size_t k;
+	for (k = pos+1; k < end && !writesReg(list[k].insn, reg, mask); k ++);
+	if (k == end || (list[k].insn.mask & mask) != mask)
+		return false;
+
+	for (size_t j = pos+1; j <= k; j ++)
+		for (int i = 0; i < irSrcCount(list[j].insn.opcode); i ++)
+		{
+			const IrInsn& in = list[j].insn;
+			if (in.src[i] == reg && !in.idx[i] && (srcReads(in, i) & mask) && (srcReads(in, i) &~ mask))
+				return false;
+		}
+
+	int temp;
+	for (temp = 0; temp < 16 && !unused[temp]; temp ++);
+	if (temp == 16)
+		return false;
+	unused[temp] = false;
+
+	r.dest = 0x10 + temp;
+	for (size_t j = pos+1; j <= k; j ++)
+		for (int i = 0; i < irSrcCount(list[j].insn.opcode); i ++)
+		{
+			IrInsn& in = list[j].insn;
+			if (in.src[i] == reg && !in.idx[i] && (srcReads(in, i) & mask))
+				in.src[i] = 0x10 + temp;
+		}
+	return true;
+}
+
+static void valueNumberRun(IrList& list, size_t begin, size_t end, ValueState& vs, std::vector<AvailExpr>& avail, bool* unused)
+{
+	for (size_t i = begin; i < end; i ++)
+	{
+		IrInsn in = list[i].insn;
+		bool candidate = in.opcode != MAESTRO_CMP && in.opcode != MAESTRO_MOVA && in.opcode != MAESTRO_MOV;
+
+		for (size_t a = avail.size(); candidate && a --; )
+		{
+			AvailExpr& e = avail[a];
+			const IrInsn& prev = (*e.list)[e.pos].insn;
+			if (!sameExpr(prev, e, in, vs))
+				continue;
+
+			int comp = 0, sw = DEFAULT_SWIZZLE;
+			if (isDot(in.opcode))
+			{
+				for (comp = 0; !(prev.mask & (8>>comp)); comp ++);
+				sw = SWIZZLE_COMP(0,comp) | SWIZZLE_COMP(1,comp) | SWIZZLE_COMP(2,comp) | SWIZZLE_COMP(3,comp);
+			} else if ((prev.mask & in.mask) != in.mask)
+				continue;
+
+			bool intact = true;
+			for (int c = 0; c < 4; c ++)
+				if ((prev.mask & (8>>c)) && vs.get(prev.dest, c) != e.destVer[c])
+					intact = false;
+			if (!intact)
+			{
+				// Only results computed earlier in the same run can be renamed
+				if (e.list != &list || e.pos < begin || !renameResult(list, e.pos, i, unused))
+					continue;
+				for (int c = 0; c < 4; c ++)
+					if (prev.mask & (8>>c))
+						vs.ver[prev.dest][c] = e.destVer[c] = ++vs.counter;
+			}
+
+			IrInsn mov;
+			memset(&mov, 0, sizeof(mov));
+			mov.opcode = MAESTRO_MOV;
+			mov.dest = in.dest;
+			mov.mask = in.mask;
+			mov.src[0] = prev.dest;
+			mov.srcSw[0] = OPSRC_MAKE(0, sw);
+			setInsn(list[i], mov);
+			optNoteAt(list[i].loc, "redundant computation replaced by a copy of r%d\n", prev.dest-0x10);
+			break;
+		}
+
+		bool record = candidate && writesTemp(in) && !readsReg(in, in.dest, 0xF);
+		AvailExpr e;
+		e.list = &list;
+		e.pos = i;
+		e.a0Ver = vs.a0Ver;
+		e.aLVer = vs.aLVer;
+		for (int s = 0; record && s < irSrcCount(in.opcode); s ++)
+			for (int c = 0; c < 4; c ++)
+				e.srcVer[s][c] = vs.get(in.src[s], c);
+
+		vs.write(list[i].insn);
+
+		if (record && list[i].insn.opcode == in.opcode)
+		{
+			for (int c = 0; c < 4; c ++)
+				e.destVer[c] = vs.get(in.dest, c);
+			avail.push_back(e);
+		}
+	}
+}
+
+// A copy whose destination gets overwritten before the end of the run can be
+// removed by making the instructions in between read the copied register
+static void propagateCopies(IrList& list, size_t begin, size_t& end)
+{
+	for (size_t i = begin; i < end; i ++)
+	{
+		const IrInsn mov = list[i].insn;
+		int reg = mov.dest, mask = mov.mask;
+		if (mov.opcode != MAESTRO_MOV || reg < 0x10 || mov.idx[0] || mov.src[0] == reg)
+			continue;
+
+		int srcMask = 0;
+		for (int c = 0; c < 4; c ++)
+			if (mask & (8>>c))
+				srcMask |= 8 >> swizzleSel(mov.srcSw[0], c);
+
+		std::vector<IrInsn> rewritten;
+		bool ok = true, clobbered = false, redefined = false;
+		size_t j;
+		for (j = i+1; ok && !redefined && j < end; j ++)
+		{
+			IrInsn in = list[j].insn;
+			for (int s = 0; s < irSrcCount(in.opcode); s ++)
+			{
+				int reads = srcReads(in, s);
+				if (in.src[s] != reg || in.idx[s] || !(reads & mask))
+					continue;
+				if ((reads &~ mask) || clobbered)
+				{
+					ok = false;
+					break;
+				}
+				int sw = 0;
+				for (int c = 0; c < 4; c ++)
+					sw |= SWIZZLE_COMP(c, swizzleSel(mov.srcSw[0], swizzleSel(in.srcSw[s], c)));
+				in.src[s] = mov.src[0];
+				in.srcSw[s] = OPSRC_MAKE((in.srcSw[s] ^ mov.srcSw[0]) & 1, sw);
+			}
+
+			IrInsn tmp = in;
+			if (!ok || !legalizeInsn(tmp))
+			{
+				ok = false;
+				break;
+			}
+			rewritten.push_back(in);
+
+			if (writesReg(in, reg, mask))
+			{
+				if ((in.mask & mask) != mask)
+					ok = false;
+				redefined = true;
+			}
+			if (writesReg(in, mov.src[0], srcMask))
+				clobbered = true;
+		}
+
+		if (!ok || !redefined)
+			continue;
+
+		for (size_t k = 0; k < rewritten.size(); k ++)
+			list[i+1+k].insn = rewritten[k];
+		optNoteAt(list[i].loc, "copy to r%d removed\n", reg-0x10);
+		list.erase(list.begin() + i);
+		end --;
+		i --;
+	}
+}
+
+// Results computed before an IF or FOR block are available inside of it, as
+// long as their registers are not overwritten. Results computed inside of a
+// block are only available within it.
+static void valueNumberList(IrList& list, ValueState& vs, std::vector<AvailExpr>& avail, bool* unused)
+{
+	size_t i = 0;
+	while (i < list.size())
+	{
+		IrNode& n = list[i];
+		if (n.hasOperands())
+		{
+			size_t end;
+			for (end = i; end < list.size() && list[end].hasOperands(); end ++);
+			valueNumberRun(list, i, end, vs, avail, unused);
+			i = end;
+			continue;
+		}
+
+		switch (n.type)
+		{
+			case IR_CALL:
+			case IR_LABEL:
+				vs.killAll();
+				avail.clear();
+				break;
+
+			case IR_IF:
+			{
+				ValueState before = vs, other = vs;
+				std::vector<AvailExpr> inner = avail;
+				valueNumberList(n.body, vs, inner, unused);
+				other.counter = vs.counter;
+				inner = avail;
+				valueNumberList(n.elseBody, other, inner, unused);
+				vs.merge(before, other);
+				break;
+			}
+
+			case IR_FOR:
+			{
+				// Registers written in the loop change from one iteration to the next
+				int written[16] = { 0 };
+				collectWrites(n.body, written);
+				for (int r = 0; r < 16; r ++)
+					vs.kill(0x10+r, written[r]);
+				vs.a0Ver = ++vs.counter;
+				vs.aLVer = ++vs.counter;
+				ValueState inner = vs;
+				std::vector<AvailExpr> innerAvail = avail;
+				valueNumberList(n.body, inner, innerAvail, unused);
+				vs.counter = inner.counter;
+				vs.aLVer = ++vs.counter;
+				break;
+			}
+		}
+		i ++;
+	}
+}
+
+// Copies are only removed within runs of instructions without flow of control
+static void propagateCopiesList(IrList& list)
+{
+	size_t i = 0;
+	while (i < list.size())
+	{
+		propagateCopiesList(list[i].body);
+		propagateCopiesList(list[i].elseBody);
+		if (!list[i].hasOperands())
+		{
+			i ++;
+			continue;
+		}
+
+		size_t end;
+		for (end = i; end < list.size() && list[end].hasOperands(); end ++);
+		propagateCopies(list, i, end);
+		i = end;
+	}
+}
+
+static void eliminateCommonExprs(void)
+{
+	bool unused[16];
+	for (int i = 0; i < 16; i ++)
+		unused[i] = true;
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		findUnusedTemps(it->second.body, unused);
+
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+	{
+		ValueState vs;
+		std::vector<AvailExpr> avail;
+		valueNumberList(it->second.body, vs, avail, unused);
+	}
+
+	// Done once all the values are numbered, as removing copies moves instructions
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+		propagateCopiesList(it->second.body);
+}
+
+// --------------------------------------------------------------------
+// Vector merging
+// --------------------------------------------------------------------
+
+// How far apart two instructions may be in order to be merged
+#define MERGE_WINDOW 16
+
+static bool canMerge(const IrInsn& a, const IrInsn& b)
+{
+	if (a.opcode != b.opcode || !irIsComponentwise(a.opcode) || a.dest != b.dest || (a.mask & b.mask))
+		return false;
+	for (int i = 0; i < irSrcCount(a.opcode); i ++)
+		if (a.src[i] != b.src[i] || a.idx[i] != b.idx[i] || (a.srcSw[i] & 1) != (b.srcSw[i] & 1))
+			return false;
+	return !readsReg(b, a.dest, a.mask);
+}
+
+// Checks whether b can be moved up past the instruction in between
+static bool canHoistPast(const IrInsn& b, const IrInsn& mid)
+{
+	if (writesReg(mid, b.dest, b.mask) || readsReg(mid, b.dest, b.mask))
+		return false;
+	for (int i = 0; i < irSrcCount(b.opcode); i ++)
+	{
+		if (b.idx[i] && mid.opcode == MAESTRO_MOVA)
+			return false;
+		if (writesReg(mid, b.src[i], srcReads(b, i)))
+			return false;
+	}
+	return true;
+}
+
+// Instructions doing the same operation on different components of the same
+// registers are merged into a single instruction with a wider write mask
+static int mergeList(IrList& list)
+{
+	int count = 0;
+	for (size_t i = 0; i < list.size(); i ++)
+	{
+		IrNode& n = list[i];
+		count += mergeList(n.body);
+		count += mergeList(n.elseBody);
+		if (!n.hasOperands())
+			continue;
+
+		for (size_t j = i+1; j < list.size() && j <= i+MERGE_WINDOW && list[j].hasOperands(); j ++)
+		{
+			IrInsn& a = list[i].insn;
+			IrInsn& b = list[j].insn;
+			if (!canMerge(a, b))
+				continue;
+
+			bool ok = true;
+			for (size_t k = i+1; ok && k < j; k ++)
+				ok = canHoistPast(b, list[k].insn);
+			if (!ok)
+				continue;
+
+			for (int s = 0; s < irSrcCount(a.opcode); s ++)
+				for (int c = 0; c < 4; c ++)
+					if (b.mask & (8>>c))
+						a.srcSw[s] = (a.srcSw[s] &~ (3 << (7-2*c))) | (swizzleSel(b.srcSw[s], c) << (7-2*c));
+			a.mask |= b.mask;
+			list.erase(list.begin() + j);
+			j --;
+			count ++;
+		}
+	}
+	return count;
+}
+
+static void mergeVectorOps(void)
+{
+	for (irProcTableIter it = irProcTable.begin(); it != irProcTable.end(); ++it)
+	{
+		int count = mergeList(it->second.body);
+		if (count)
+			optNote("merged %d component-wise instruction%s into vector instructions in '%s'\n", count, count == 1 ? "" : "s", it->first.c_str());
+	}
+}
+
+int OptimizeProduct(void)
+{
+	if (decodeProgram() != 0)
+	{
+		irProcTable.clear();
+		return 0;
+	}
+
+	size_t oldSize = BUF.size();
+	int oldOpdescCount = g_opdescCount;
+
+	specializeVariants();
+	stripDeadProcs();
+	mergeIdenticalProcs();
+	if (g_optLevel >= 2)
+	{
+		inlineProcs();
+		if (g_optLevel >= 3)
+			unrollLoops();
+		foldConstants();
+		reduceStrength();
+		hoistInvariants();
+		eliminateCommonExprs();
+		mergeVectorOps();
+		mergeIdenticalProcs();
+	}
+	optimizeTailCalls();
+
+	std::vector<IrProc*> layout;
+	layoutProgram(layout);
+	safe_call(emitProgram(layout));
+
+	optNote("program size: %u -> %u instructions, %d -> %d operand descriptors\n",
+		(unsigned)oldSize, (unsigned)BUF.size(), oldOpdescCount, g_opdescCount);
+	irProcTable.clear();
+	return 0;
+}
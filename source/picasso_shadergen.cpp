@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <string>
+#include "types.h"
+
+// Generates a corpus of valid shaders for benchmarking picasso. The output
+// only depends on the options, so corpora are the same on every platform.
+
+// Shader code memory is addressed with 12 bits, leave room for padding NOPs
+#define MAX_CORPUS_SIZE 3600
+#define VSH_SIZE_LIMIT 400
+#define HELPERS_PER_FILE 2
+
+static u32 rngState;
+
+static u32 rng(void)
+{
+	// xorshift32
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static int pick(int n)
+{
+	return n > 1 ? rng() % n : 0;
+}
+
+struct Generator
+{
+	FILE* f;
+	int file, fileCount;
+	bool isGsh;
+	int mix[3];   // Weights of ALU, mad and flow control statements
+	int labels;
+	int depth;    // Nesting of IF blocks
+	bool inLoop;
+
+	void line(const char* fmt, ...)
+	{
+		for (int i = 0; i <= depth; i ++)
+			fputc('\t', f);
+		va_list v;
+		va_start(v, fmt);
+		vfprintf(f, fmt, v);
+		va_end(v);
+		fputc('\n', f);
+	}
+
+	std::string reg(void)
+	{
+		char buf[8];
+		snprintf(buf, sizeof(buf), "r%d", pick(12));
+		return buf;
+	}
+
+	// Narrow source: scratch register
+	std::string narrow(void)
+	{
+		return reg() + swizzle();
+	}
+
+	// Wide source: also inputs, uniforms, constants and constant arrays. Only
+	// one input register can be read per instruction, so they only appear here
+	std::string wide(void)
+	{
+		char buf[32];
+		switch (pick(inLoop ? 7 : 6))
+		{
+			case 0: snprintf(buf, sizeof(buf), "mtx[%d]", pick(4)); break;
+			case 1: snprintf(buf, sizeof(buf), "k%d", file); break;
+			case 2: snprintf(buf, sizeof(buf), "tint%d", file); break;
+			case 3: snprintf(buf, sizeof(buf), "v%d", pick(4)); break;
+			case 6: snprintf(buf, sizeof(buf), "arr%d[aL]", file); break;
+			default: return narrow();
+		}
+		return buf + swizzle();
+	}
+
+	// Few swizzles and masks, so the operand descriptors fit in the table
+	std::string swizzle(void)
+	{
+		static const char* const swizzles[] = { "", "", ".xxxx", ".wzyx" };
+		return swizzles[pick(4)];
+	}
+
+	std::string dest(void)
+	{
+		static const char* const masks[] = { "", "", ".xyz", ".x" };
+		return reg() + masks[pick(4)];
+	}
+
+	int alu(void)
+	{
+		static const char* const binOps[] = { "add", "mul", "max", "min", "dp3", "dp4", "dph", "sge", "slt" };
+		static const char* const unOps[] = { "mov", "mov", "flr", "rcp", "rsq", "ex2", "lg2" };
+		if (pick(3))
+			line("%s %s, %s, %s", binOps[pick(9)], dest().c_str(), wide().c_str(), narrow().c_str());
+		else
+			line("%s %s, %s", unOps[pick(7)], dest().c_str(), wide().c_str());
+		return 1;
+	}
+
+	int mad(void)
+	{
+		// MAD can only use the first 32 operand descriptors
+		line("mad %s, %s, %s, %s", dest().c_str(), reg().c_str(), wide().c_str(), reg().c_str());
+		return 1;
+	}
+
+	int block(int budget)
+	{
+		int used = 0;
+		while (used < budget)
+			used += statement(budget - used);
+		return used;
+	}
+
+	int cmp(void)
+	{
+		static const char* const ops[] = { "eq", "ne", "lt", "le", "gt", "ge" };
+		line("cmp %s, %s, %s, %s", wide().c_str(), ops[pick(6)], ops[pick(6)], narrow().c_str());
+		return 1;
+	}
+
+	int flow(int budget)
+	{
+		static const char* const conds[] = { "cmp.x", "!cmp.y", "cmp.x && cmp.y", "cmp.x || !cmp.y" };
+		int kind = pick(6);
+		if (budget < 6 || (depth >= 2 && kind < 3) || (inLoop && kind == 2))
+			kind = 3 + pick(3);
+
+		int used = 1;
+		switch (kind)
+		{
+			case 0: case 1:
+			{
+				// IF/ELSE on a uniform or a comparison
+				if (kind == 0)
+					line("ifu flag%d_%d", file, pick(2));
+				else
+				{
+					used += cmp();
+					line("ifc %s", conds[pick(4)]);
+				}
+				int half = (budget - used) / 2;
+				depth ++;
+				used += block(1 + pick(half));
+				if (pick(2))
+				{
+					depth --;
+					line(".else");
+					depth ++;
+					used += block(1 + pick(half));
+				}
+				depth --;
+				line(".end");
+				break;
+			}
+			case 2:
+			{
+				// Loop reading the constant array
+				line("for %s%d", pick(2) ? "count" : "loops", file);
+				depth ++;
+				inLoop = true;
+				used += block(1 + pick(std::min(budget - used, 8)));
+				inLoop = false;
+				depth --;
+				line(".end");
+				break;
+			}
+			case 3:
+			{
+				// Call into a procedure of this or another file
+				int target = pick(2) ? file : pick(fileCount);
+				if (pick(2))
+					line("call helper%d_%d", target, pick(HELPERS_PER_FILE));
+				else
+					line("callu flag%d_%d, helper%d_%d", file, pick(2), target, pick(HELPERS_PER_FILE));
+				break;
+			}
+			case 4:
+			{
+				// Forward jump within the block
+				int label = labels ++;
+				used += cmp();
+				line("jmpc %s, skip%d", conds[pick(4)], label);
+				used += block(1 + pick(std::min(budget - used, 4)));
+				fprintf(f, "skip%d:\n", label);
+				break;
+			}
+			default:
+				used = alu();
+				break;
+		}
+		return used;
+	}
+
+	int statement(int budget)
+	{
+		int r = pick(mix[0] + mix[1] + mix[2]);
+		if (r < mix[0])
+			return alu();
+		if (r < mix[0] + mix[1])
+			return mad();
+		return flow(budget);
+	}
+
+	void header(void)
+	{
+		fprintf(f, "; Generated by picasso-shadergen\n");
+		if (isGsh)
+			fprintf(f, ".gsh point c0\n");
+		fprintf(f, "\n.fvec mtx[4], tint%d\n", file);
+		fprintf(f, ".bool flag%d_0, flag%d_1\n", file, file);
+		fprintf(f, ".ivec loops%d\n", file);
+		fprintf(f, ".consti count%d(%d, 0, 1, 0)\n", file, 1 + pick(4));
+		fprintf(f, ".constf k%d(0.5, 1.0, 2.0, -1.0)\n", file);
+		fprintf(f, ".constfa arr%d[]\n", file);
+		for (int i = 0; i < 4; i ++)
+			fprintf(f, ".constfa (%d.0, %d.5, -%d.0, 1.0)\n", i, i, i+1);
+		fprintf(f, ".end\n\n");
+		fprintf(f, ".out opos position\n.out oclr color\n.out otex texcoord0.xy\n\n");
+		fprintf(f, ".entry main%d\n\n", file);
+	}
+
+	void generate(int size)
+	{
+		header();
+
+		// Small procedures shared by all files, straight-line so calls never recurse
+		for (int i = 0; i < HELPERS_PER_FILE; i ++)
+		{
+			fprintf(f, ".proc helper%d_%d\n", file, i);
+			int n = 2 + pick(5);
+			for (int j = 0; j < n; j ++)
+				pick(mix[0] + mix[1]) < mix[0] ? alu() : mad();
+			fprintf(f, ".end\n\n");
+			size -= n;
+		}
+
+		fprintf(f, ".proc main%d\n", file);
+		block(size > 8 ? size - 8 : 1);
+		line("mov opos, r0");
+		line("mov oclr, r1");
+		line("mov otex, r2.xy");
+		if (isGsh)
+		{
+			line("setemit 0, prim");
+			line("emit");
+		}
+		line("end");
+		fprintf(f, ".end\n");
+	}
+};
+
+static int usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"  -o, --out=<dir>         Specifies the directory to write the shaders to (default .)\n"
+		"  -n, --files=<n>         Specifies the number of source files (default 16)\n"
+		"  -s, --size=<n>          Specifies the number of instructions per file (default 200)\n"
+		"  -m, --mix=<a>,<m>,<f>   Weights of ALU, mad and flow control statements (default 60,20,20)\n"
+		"  -r, --seed=<n>          Specifies the random seed (default 1)\n"
+		, prog);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* outDir = ".";
+	int files = 16, size = 200, seed = 1;
+	int mix[3] = { 60, 20, 20 };
+
+	static struct option long_options[] =
+	{
+		{ "out",   required_argument, NULL, 'o' },
+		{ "files", required_argument, NULL, 'n' },
+		{ "size",  required_argument, NULL, 's' },
+		{ "mix",   required_argument, NULL, 'm' },
+		{ "seed",  required_argument, NULL, 'r' },
+		{ "help",  no_argument,       NULL, '?' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int opt, optidx = 0;
+	while ((opt = getopt_long(argc, argv, "o:n:s:m:r:?", long_options, &optidx)) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': outDir = optarg; break;
+			case 'n': files = atoi(optarg); break;
+			case 's': size = atoi(optarg); break;
+			case 'm':
+				if (sscanf(optarg, "%d,%d,%d", &mix[0], &mix[1], &mix[2]) != 3)
+					return usage(argv[0]);
+				break;
+			case 'r': seed = atoi(optarg); break;
+			case '?': usage(argv[0]); return EXIT_SUCCESS;
+			default:  return usage(argv[0]);
+		}
+	}
+
+	if (files < 1 || size < 16 || mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] == 0)
+		return usage(argv[0]);
+	if (files * size > MAX_CORPUS_SIZE)
+	{
+		fprintf(stderr, "error: %d files of %d instructions do not fit in shader code memory (max %d instructions)\n", files, size, MAX_CORPUS_SIZE);
+		return EXIT_FAILURE;
+	}
+
+	rngState = seed ? seed : 1;
+	for (int i = 0; i < files; i ++)
+	{
+		// Vertex shaders must fit in the first 512 words, so only the first
+		// file can be one
+		Generator g;
+		g.isGsh = i > 0 || size > VSH_SIZE_LIMIT;
+
+		char name[1024];
+		snprintf(name, sizeof(name), "%s/shader%03d.%s", outDir, i, g.isGsh ? "gsh" : "vsh");
+		g.f = fopen(name, "w");
+		if (!g.f)
+		{
+			fprintf(stderr, "error: cannot open output file: %s\n", name);
+			return EXIT_FAILURE;
+		}
+
+		g.file = i;
+		g.fileCount = files;
+		memcpy(g.mix, mix, sizeof(mix));
+		g.labels = 0;
+		g.depth = 0;
+		g.inLoop = false;
+		g.generate(size);
+		fclose(g.f);
+		printf("%s\n", name);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1490 @@
+#include "picasso_sim.h"
+
+u64 g_simMaxSteps = SIM_DEFAULT_MAX_STEPS;
+bool g_simTrace;
+bool g_simScalar;
+const int* g_simLatency;
+
+static int simError(const char* msg, ...)
+{
+	va_list v;
+
+	fprintf(stderr, "error: ");
+
+	va_start(v, msg);
+	vfprintf(stderr, msg, v);
+	va_end(v);
+
+	return 1;
+}
+
+// --------------------------------------------------------------------
+// SHBIN loading
+// --------------------------------------------------------------------
+
+typedef std::vector<u8> simFileType;
+
+static inline bool simInRange(const simFileType& f, size_t off, size_t size)
+{
+	return off <= f.size() && size <= f.size() - off;
+}
+
+static inline u32 simWord(const simFileType& f, size_t off)
+{
+	return f[off] | (f[off+1] << 8) | (f[off+2] << 16) | ((u32)f[off+3] << 24);
+}
+
+static inline u16 simHword(const simFileType& f, size_t off)
+{
+	return f[off] | (f[off+1] << 8);
+}
+
+static int loadDvle(const simFileType& f, size_t base, SimDvle& dvle)
+{
+	if (!simInRange(f, base, 16*4) || simWord(f, base) != 0x454C5644)
+		return simError("invalid DVLE at offset 0x%X\n", (unsigned)base);
+
+	dvle.isGeoShader = f[base+6] != 0;
+	dvle.isMerge = f[base+7] != 0;
+	dvle.entryStart = simWord(f, base+8);
+	dvle.entryEnd = simWord(f, base+12);
+	dvle.inputMask = simHword(f, base+16);
+	dvle.outputMask = simHword(f, base+18);
+	dvle.geoShaderType = f[base+20];
+	dvle.geoShaderFixedStart = f[base+21];
+	dvle.geoShaderVariableNum = f[base+22];
+	dvle.geoShaderFixedNum = f[base+23];
+
+	size_t constOff = base + simWord(f, base+24), constCount = simWord(f, base+28);
+	size_t outOff = base + simWord(f, base+40), outCount = simWord(f, base+44);
+	size_t unifOff = base + simWord(f, base+48), unifCount = simWord(f, base+52);
+	size_t symOff = base + simWord(f, base+56), symSize = simWord(f, base+60);
+
+	if (!simInRange(f, constOff, constCount*20) || !simInRange(f, outOff, outCount*8)
+		|| !simInRange(f, unifOff, unifCount*8) || !simInRange(f, symOff, symSize))
+		return simError("truncated DVLE at offset 0x%X\n", (unsigned)base);
+
+	for (size_t i = 0; i < constCount; i ++)
+	{
+		size_t off = constOff + i*20;
+		Constant ct;
+		memset(&ct, 0, sizeof(ct));
+		ct.type = simHword(f, off);
+		ct.regId = simHword(f, off+2);
+		switch (ct.type)
+		{
+			case UTYPE_BOOL:
+				ct.regId += 0x88;
+				ct.bparam = simWord(f, off+4) != 0;
+				break;
+			case UTYPE_IVEC:
+				ct.regId += 0x80;
+				for (int j = 0; j < 4; j ++)
+					ct.iparam[j] = f[off+4+j];
+				break;
+			case UTYPE_FVEC:
+				ct.regId += 0x20;
+				for (int j = 0; j < 4; j ++)
+					ct.fparam[j] = f24tof32(simWord(f, off+4+j*4));
+				break;
+			default:
+				return simError("unknown constant type %d\n", ct.type);
+		}
+		dvle.constants.push_back(ct);
+	}
+
+	for (size_t i = 0; i < outCount; i ++)
+		dvle.outputs.push_back(simWord(f, outOff+i*8) | ((u64)simWord(f, outOff+i*8+4) << 32));
+
+	for (size_t i = 0; i < unifCount; i ++)
+	{
+		size_t off = unifOff + i*8;
+		size_t name = simWord(f, off);
+		int start = simHword(f, off+4), end = simHword(f, off+6);
+		if (name >= symSize || end < start)
+			return simError("invalid uniform entry in DVLE at offset 0x%X\n", (unsigned)base);
+
+		SimSymbol sym;
+		const char* str = (const char*)&f[symOff+name];
+		sym.name.assign(str, strnlen(str, symSize-name));
+		sym.reg = start >= 0x10 ? start+0x10 : start;
+		sym.size = end-start+1;
+		dvle.symbols.push_back(sym);
+	}
+
+	return 0;
+}
+
+int SimLoadShbin(const char* filename, SimProgram& prog)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (!fp)
+		return simError("cannot open input file: %s\n", filename);
+
+	simFileType f;
+	u8 buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		f.insert(f.end(), buf, buf+n);
+	fclose(fp);
+
+	if (!simInRange(f, 0, 8) || simWord(f, 0) != 0x424C5644)
+		return simError("%s is not a SHBIN file\n", filename);
+
+	size_t dvleCount = simWord(f, 4);
+	size_t dvlp = 8 + dvleCount*4;
+	if (!simInRange(f, 8, dvleCount*4) || !simInRange(f, dvlp, 10*4) || simWord(f, dvlp) != 0x504C5644)
+		return simError("%s: invalid DVLP header\n", filename);
+
+	size_t codeOff = dvlp + simWord(f, dvlp+8), codeSize = simWord(f, dvlp+12);
+	size_t opdescOff = dvlp + simWord(f, dvlp+16), opdescCount = simWord(f, dvlp+20);
+	if (!simInRange(f, codeOff, codeSize*4) || !simInRange(f, opdescOff, opdescCount*8))
+		return simError("%s: truncated DVLP\n", filename);
+
+	prog.code.resize(codeSize);
+	for (size_t i = 0; i < codeSize; i ++)
+		prog.code[i] = simWord(f, codeOff + i*4);
+
+	// Missing opdescs read as zero, like unset registers on hardware
+	prog.opdescs.assign(MAX_OPDESC, 0);
+	for (size_t i = 0; i < opdescCount && i < MAX_OPDESC; i ++)
+		prog.opdescs[i] = simWord(f, opdescOff + i*8);
+
+	// FNV-1a over the program and opdescs, used to cache translations
+	prog.hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < codeSize*4; i ++)
+		prog.hash = (prog.hash ^ f[codeOff+i]) * 1099511628211ULL;
+	for (size_t i = 0; i < MAX_OPDESC; i ++)
+		prog.hash = (prog.hash ^ prog.opdescs[i]) * 1099511628211ULL;
+
+	prog.dvles.resize(dvleCount);
+	for (size_t i = 0; i < dvleCount; i ++)
+		safe_call(loadDvle(f, simWord(f, 8 + i*4), prog.dvles[i]));
+
+	return 0;
+}
+
+int SimLoadLineTable(const char* filename, SimLineTable& table)
+{
+	FILE* f = fopen(filename, "r");
+	if (!f)
+		return simError("cannot open line table: %s\n", filename);
+
+	char line[1024];
+	int lineNo = 0, rc = 0;
+	while (!rc && fgets(line, sizeof(line), f))
+	{
+		lineNo ++;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!*line || *line == '#')
+			continue;
+
+		unsigned pc, idx, start, size;
+		int file, srcLine, proc = -1, len = 0;
+		if (sscanf(line, "file %u %n", &idx, &len) == 1 && len && idx < 0x10000)
+		{
+			if (table.files.size() <= idx)
+				table.files.resize(idx+1);
+			table.files[idx] = line + len;
+		} else if (sscanf(line, "proc %u %u %u %n", &idx, &start, &size, &len) == 3 && len && idx < 0x10000)
+		{
+			if (table.procs.size() <= idx)
+				table.procs.resize(idx+1);
+			table.procs[idx] = line + len;
+		} else if (sscanf(line, "%u %d %d %d", &pc, &file, &srcLine, &proc) >= 3)
+		{
+			if (pc >= 0x10000)
+				rc = simError("%s:%d: invalid program counter\n", filename, lineNo);
+			else
+			{
+				SourceLoc unknown = { -1, 0 }, loc = { file, srcLine };
+				if (table.locs.size() <= pc)
+				{
+					table.locs.resize(pc+1, unknown);
+					table.owners.resize(pc+1, -1);
+				}
+				table.locs[pc] = loc;
+				table.owners[pc] = proc;
+			}
+		} else if (isdigit((unsigned char)*line))
+			rc = simError("%s:%d: syntax error\n", filename, lineNo);
+		// Other records are left for other tools
+	}
+
+	fclose(f);
+	return rc;
+}
+
+void SimApplyConstants(const SimDvle& dvle, SimInputs& in)
+{
+	for (size_t i = 0; i < dvle.constants.size(); i ++)
+	{
+		const Constant& ct = dvle.constants[i];
+		if (ct.type == UTYPE_FVEC && ct.regId < 0x80)
+			memcpy(in.c[ct.regId-0x20], ct.fparam, sizeof(ct.fparam));
+		else if (ct.type == UTYPE_IVEC && ct.regId < 0x84)
+			memcpy(in.i[ct.regId-0x80], ct.iparam, sizeof(ct.iparam));
+		else if (ct.type == UTYPE_BOOL && ct.regId < 0x98)
+			in.b[ct.regId-0x88] = ct.bparam;
+	}
+}
+
+// --------------------------------------------------------------------
+// Interpreter
+// --------------------------------------------------------------------
+
+struct SimStackEntry
+{
+	size_t finalPc, returnPc, loopPc;
+	int repeat, increment;
+	bool isLoop, isCall;
+};
+
+struct SimContext
+{
+	const SimProgram* prog;
+	const SimInputs* in;
+	SimOutputs* out;
+
+	float r[16][4];
+	int a0[2], aL;
+	bool cmp[2];
+
+	SimStackEntry stack[SIM_MAX_STACK];
+	int stackPos;
+	size_t pc;
+
+	int emitVertex;
+	bool emitPrim, emitWinding;
+
+	SimProfileEntry* profile; // NULL unless profiling
+};
+
+static const float simOne[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+// The PICA200 defines 0 * inf as 0
+static inline float simMul(float a, float b)
+{
+	float r = a * b;
+	return r != r && a == a && b == b ? 0.0f : r;
+}
+
+static inline float simDot(const float* a, const float* b, int n)
+{
+	float r = simMul(a[0], b[0]);
+	for (int k = 1; k < n; k ++)
+		r += simMul(a[k], b[k]);
+	return r;
+}
+
+static void readSrc(SimContext& ctx, int reg, int idx, u32 opsrc, float out[4])
+{
+	const float* vec;
+	if (reg < 0x10)
+		vec = ctx.in->v[reg];
+	else if (reg < 0x20)
+		vec = ctx.r[reg-0x10];
+	else
+	{
+		// Relative addressing only applies to float uniforms
+		int n = reg - 0x20;
+		if (idx)
+			n += idx == 3 ? ctx.aL : ctx.a0[idx-1];
+		vec = n >= 0 && n < 96 ? ctx.in->c[n] : simOne;
+	}
+
+	int sw = opsrc >> 1;
+	for (int k = 0; k < 4; k ++)
+	{
+		float x = vec[(sw >> (6-2*k)) & 3];
+		out[k] = (opsrc & 1) ? -x : x;
+	}
+}
+
+static inline u32 opsrc(u32 desc, int i)
+{
+	return (desc >> (4 + 9*i)) & 0x1FF;
+}
+
+static inline bool compare(int op, float a, float b)
+{
+	switch (op)
+	{
+		case COND_EQ: return a == b;
+		case COND_NE: return a != b;
+		case COND_LT: return a < b;
+		case COND_LE: return a <= b;
+		case COND_GT: return a > b;
+		case COND_GE: return a >= b;
+	}
+	return false;
+}
+
+static int execAlu(SimContext& ctx, u32 w)
+{
+	const std::vector<u32>& opdescs = ctx.prog->opdescs;
+	int op = w >> 26;
+	float s1[4], s2[4], s3[4], res[4];
+	u32 desc;
+	int dest;
+
+	if (op >= MAESTRO_MADI)
+	{
+		bool inverted = op < MAESTRO_MAD;
+		int idx = (w>>22) & 3;
+		desc = opdescs[w & 0x1F];
+		dest = (w>>24) & 0x1F;
+		readSrc(ctx, (w>>17) & 0x1F, 0, opsrc(desc, 0), s1);
+		if (inverted)
+		{
+			readSrc(ctx, (w>>12) & 0x1F, 0, opsrc(desc, 1), s2);
+			readSrc(ctx, (w>>5) & 0x7F, idx, opsrc(desc, 2), s3);
+		} else
+		{
+			readSrc(ctx, (w>>10) & 0x7F, idx, opsrc(desc, 1), s2);
+			readSrc(ctx, (w>>5) & 0x1F, 0, opsrc(desc, 2), s3);
+		}
+		for (int k = 0; k < 4; k ++)
+			res[k] = simMul(s1[k], s2[k]) + s3[k];
+	} else
+	{
+		bool inverted = op >= MAESTRO_DPHI && op <= MAESTRO_SLTI;
+		int idx = (w>>19) & 3;
+		desc = opdescs[w & 0x7F];
+		dest = (w>>21) & 0x1F;
+		if (inverted)
+		{
+			readSrc(ctx, (w>>14) & 0x1F, 0, opsrc(desc, 0), s1);
+			readSrc(ctx, (w>>7) & 0x7F, idx, opsrc(desc, 1), s2);
+		} else
+		{
+			readSrc(ctx, (w>>12) & 0x7F, idx, opsrc(desc, 0), s1);
+			readSrc(ctx, (w>>7) & 0x1F, 0, opsrc(desc, 1), s2);
+		}
+
+		switch (op)
+		{
+			case MAESTRO_ADD:
+				for (int k = 0; k < 4; k ++) res[k] = s1[k] + s2[k];
+				break;
+			case MAESTRO_MUL:
+				for (int k = 0; k < 4; k ++) res[k] = simMul(s1[k], s2[k]);
+				break;
+			case MAESTRO_DP3:
+				res[0] = res[1] = res[2] = res[3] = simDot(s1, s2, 3);
+				break;
+			case MAESTRO_DP4:
+				res[0] = res[1] = res[2] = res[3] = simDot(s1, s2, 4);
+				break;
+			case MAESTRO_DPH:
+			case MAESTRO_DPHI:
+				res[0] = res[1] = res[2] = res[3] = simDot(s1, s2, 3) + s2[3];
+				break;
+			case MAESTRO_DST:
+			case MAESTRO_DSTI:
+				res[0] = 1.0f;
+				res[1] = simMul(s1[1], s2[1]);
+				res[2] = s1[2];
+				res[3] = s2[3];
+				break;
+			case MAESTRO_EX2:
+				res[0] = res[1] = res[2] = res[3] = exp2f(s1[0]);
+				break;
+			case MAESTRO_LG2:
+				res[0] = res[1] = res[2] = res[3] = log2f(s1[0]);
+				break;
+			case MAESTRO_LITP:
+				res[0] = std::max(s1[0], 0.0f);
+				res[1] = std::min(std::max(s1[1], -127.9961f), 127.9961f);
+				res[2] = s1[2];
+				res[3] = std::max(s1[3], 0.0f);
+				break;
+			case MAESTRO_SGE:
+			case MAESTRO_SGEI:
+				for (int k = 0; k < 4; k ++) res[k] = s1[k] >= s2[k] ? 1.0f : 0.0f;
+				break;
+			case MAESTRO_SLT:
+			case MAESTRO_SLTI:
+				for (int k = 0; k < 4; k ++) res[k] = s1[k] < s2[k] ? 1.0f : 0.0f;
+				break;
+			case MAESTRO_FLR:
+				for (int k = 0; k < 4; k ++) res[k] = floorf(s1[k]);
+				break;
+			case MAESTRO_MAX:
+				for (int k = 0; k < 4; k ++) res[k] = s1[k] > s2[k] ? s1[k] : s2[k];
+				break;
+			case MAESTRO_MIN:
+				for (int k = 0; k < 4; k ++) res[k] = s1[k] < s2[k] ? s1[k] : s2[k];
+				break;
+			case MAESTRO_RCP:
+				res[0] = res[1] = res[2] = res[3] = 1.0f / s1[0];
+				break;
+			case MAESTRO_RSQ:
+				res[0] = res[1] = res[2] = res[3] = 1.0f / sqrtf(s1[0]);
+				break;
+			case MAESTRO_MOV:
+				memcpy(res, s1, sizeof(res));
+				break;
+			case MAESTRO_MOVA:
+				if (desc & BIT(3)) ctx.a0[0] = (int)s1[0];
+				if (desc & BIT(2)) ctx.a0[1] = (int)s1[1];
+				return 0;
+			case MAESTRO_CMP:
+			case MAESTRO_CMP+1:
+				ctx.cmp[0] = compare((w>>24) & 7, s1[0], s2[0]);
+				ctx.cmp[1] = compare((w>>21) & 7, s1[1], s2[1]);
+				return 0;
+			default:
+				return simError("unknown opcode 0x%02X at %u\n", op, (unsigned)ctx.pc);
+		}
+	}
+
+	float* tgt = dest < 0x10 ? ctx.out->o[dest] : ctx.r[dest-0x10];
+	for (int k = 0; k < 4; k ++)
+		if (desc & BIT(3-k))
+			tgt[k] = f24round(res[k]);
+	return 0;
+}
+
+static inline bool evalCond(SimContext& ctx, u32 w)
+{
+	bool x = ctx.cmp[0] == (bool)((w>>25) & 1);
+	bool y = ctx.cmp[1] == (bool)((w>>24) & 1);
+	switch ((w>>22) & 3)
+	{
+		case 0: return x || y;
+		case 1: return x && y;
+		case 2: return x;
+		default: return y;
+	}
+}
+
+static int pushBlock(SimContext& ctx, size_t start, size_t num, size_t ret, int repeat = 0, int increment = 0, bool isLoop = false)
+{
+	if (ctx.stackPos == SIM_MAX_STACK)
+		return simError("stack overflow at %u\n", (unsigned)ctx.pc);
+
+	SimStackEntry& e = ctx.stack[ctx.stackPos++];
+	e.finalPc = start + num;
+	e.returnPc = ret;
+	e.loopPc = start;
+	e.repeat = repeat;
+	e.increment = increment;
+	e.isLoop = isLoop;
+	e.isCall = false;
+	ctx.pc = start;
+	return 0;
+}
+
+static inline void profileBranch(SimContext& ctx, bool taken)
+{
+	if (ctx.profile)
+		(taken ? ctx.profile[ctx.pc].taken : ctx.profile[ctx.pc].notTaken) ++;
+}
+
+static void profileStep(SimContext& ctx)
+{
+	SimProfileEntry& p = ctx.profile[ctx.pc];
+	int depth = 0;
+	for (int i = 0; i < ctx.stackPos; i ++)
+		depth += ctx.stack[i].isCall;
+	p.count ++;
+	p.maxDepth = std::max(p.maxDepth, depth);
+}
+
+// Returns 1 when the program has ended
+static int execFlow(SimContext& ctx, u32 w)
+{
+	int op = w >> 26;
+	size_t dst = (w>>10) & 0xFFF, num = w & 0x3FF;
+	bool taken;
+
+	switch (op)
+	{
+		case MAESTRO_NOP:
+			break;
+		case MAESTRO_END:
+			return 1;
+		case MAESTRO_BREAK:
+		case MAESTRO_BREAKC:
+			if (op == MAESTRO_BREAKC)
+			{
+				taken = evalCond(ctx, w);
+				profileBranch(ctx, taken);
+				if (!taken)
+					break;
+			}
+			while (ctx.stackPos && !ctx.stack[ctx.stackPos-1].isLoop)
+				ctx.stackPos--;
+			if (!ctx.stackPos)
+				return simError("break outside of a loop at %u\n", (unsigned)ctx.pc);
+			ctx.pc = ctx.stack[--ctx.stackPos].returnPc;
+			return 0;
+		case MAESTRO_CALL:
+		case MAESTRO_CALLC:
+		case MAESTRO_CALLU:
+			if (op == MAESTRO_CALL)
+				taken = true;
+			else if (op == MAESTRO_CALLC)
+				taken = evalCond(ctx, w);
+			else
+				taken = ctx.in->b[(w>>22) & 0xF];
+			if (op != MAESTRO_CALL)
+				profileBranch(ctx, taken);
+			if (!taken)
+				break;
+			safe_call(pushBlock(ctx, dst, num, ctx.pc+1));
+			ctx.stack[ctx.stackPos-1].isCall = true;
+			return 0;
+		case MAESTRO_IFU:
+		case MAESTRO_IFC:
+			taken = op == MAESTRO_IFU ? ctx.in->b[(w>>22) & 0xF] : evalCond(ctx, w);
+			profileBranch(ctx, taken);
+			if (taken)
+				return pushBlock(ctx, ctx.pc+1, dst-ctx.pc-1, dst+num);
+			return pushBlock(ctx, dst, num, dst+num);
+		case MAESTRO_FOR:
+		{
+			const u8* i = ctx.in->i[(w>>22) & 3];
+			ctx.aL = i[1];
+			if (ctx.profile)
+			{
+				ctx.profile[ctx.pc].loops ++;
+				ctx.profile[ctx.pc].trips ++;
+			}
+			return pushBlock(ctx, ctx.pc+1, dst-ctx.pc, dst+1, i[0], i[2], true);
+		}
+		case MAESTRO_EMIT:
+		{
+			SimEmit e;
+			memcpy(e.o, ctx.out->o, sizeof(e.o));
+			e.vertexId = ctx.emitVertex;
+			e.primEmit = ctx.emitPrim;
+			e.winding = ctx.emitWinding;
+			ctx.out->emitted.push_back(e);
+			break;
+		}
+		case MAESTRO_SETEMIT:
+			ctx.emitWinding = (w>>22) & 1;
+			ctx.emitPrim = (w>>23) & 1;
+			ctx.emitVertex = (w>>24) & 3;
+			break;
+		case MAESTRO_JMPC:
+		case MAESTRO_JMPU:
+			if (op == MAESTRO_JMPC)
+				taken = evalCond(ctx, w);
+			else
+				taken = ctx.in->b[(w>>22) & 0xF] == !(w & 1);
+			profileBranch(ctx, taken);
+			if (!taken)
+				break;
+			ctx.pc = dst;
+			return 0;
+	}
+
+	ctx.pc ++;
+	return 0;
+}
+
+int SimRun(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimOutputs& out, SimStats* stats)
+{
+	SimContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.prog = &prog;
+	ctx.in = &in;
+	ctx.out = &out;
+	ctx.pc = dvle.entryStart;
+	memset(out.o, 0, sizeof(out.o));
+	out.emitted.clear();
+
+	if (stats && !stats->profile.empty())
+	{
+		if (stats->profile.size() < prog.code.size())
+			stats->profile.resize(prog.code.size());
+		ctx.profile = &stats->profile[0];
+	}
+
+	u64 steps = 0, cycles = 0;
+	for (;;)
+	{
+		// Leave finished blocks, repeating loops as needed
+		if (ctx.stackPos && ctx.pc == ctx.stack[ctx.stackPos-1].finalPc)
+		{
+			SimStackEntry& e = ctx.stack[ctx.stackPos-1];
+			if (e.isLoop)
+				ctx.aL = (ctx.aL + e.increment) & 0xFF;
+			if (e.repeat)
+			{
+				e.repeat--;
+				ctx.pc = e.loopPc;
+				if (ctx.profile)
+					ctx.profile[e.loopPc-1].trips ++;
+			} else
+			{
+				ctx.pc = e.returnPc;
+				ctx.stackPos--;
+			}
+			continue;
+		}
+
+		if (ctx.pc >= prog.code.size())
+			return simError("program counter out of range: %u\n", (unsigned)ctx.pc);
+		if (++steps > g_simMaxSteps)
+			return simError("step limit exceeded (%llu instructions)\n", (unsigned long long)g_simMaxSteps);
+
+		u32 w = prog.code[ctx.pc];
+		int op = w >> 26;
+		if (g_simTrace)
+			fprintf(stderr, "%4u: %08X\n", (unsigned)ctx.pc, w);
+		if (ctx.profile)
+			profileStep(ctx);
+		if (g_simLatency)
+			cycles += g_simLatency[op];
+
+		if (op < 0x20 || op >= MAESTRO_CMP)
+		{
+			safe_call(execAlu(ctx, w));
+			ctx.pc ++;
+		} else
+		{
+			int rc = execFlow(ctx, w);
+			if (rc == 1 && op == MAESTRO_END)
+				break;
+			if (rc)
+				return rc;
+		}
+	}
+
+	if (stats)
+	{
+		stats->insnCount += steps;
+		stats->cycleCount += cycles;
+		stats->vertexCount ++;
+	}
+	return 0;
+}
+
+// --------------------------------------------------------------------
+// Translation
+// --------------------------------------------------------------------
+
+// Translated programs, by program hash
+static std::map<u64, SimCode> simCodeCache;
+
+static void translateSrc(SimOpSrc& s, int reg, int idx, u32 opsrc)
+{
+	s.reg = reg;
+	s.idx = idx;
+	s.neg = opsrc & 1;
+	for (int k = 0; k < 4; k ++)
+		s.sw[k] = (opsrc >> (7-2*k)) & 3;
+}
+
+static void translateInsn(u32 w, const std::vector<u32>& opdescs, SimOp& o)
+{
+	memset(&o, 0, sizeof(o));
+	o.word = w;
+	o.op = w >> 26;
+
+	// Flow of control instructions are decoded when executed
+	if (o.op >= 0x20 && o.op < MAESTRO_CMP)
+		return;
+
+	u32 desc;
+	if (o.op >= MAESTRO_MADI)
+	{
+		bool inverted = o.op < MAESTRO_MAD;
+		int idx = (w>>22) & 3;
+		desc = opdescs[w & 0x1F];
+		o.op = MAESTRO_MAD;
+		o.dest = (w>>24) & 0x1F;
+		o.srcCount = 3;
+		translateSrc(o.src[0], (w>>17) & 0x1F, 0, opsrc(desc, 0));
+		if (inverted)
+		{
+			translateSrc(o.src[1], (w>>12) & 0x1F, 0, opsrc(desc, 1));
+			translateSrc(o.src[2], (w>>5) & 0x7F, idx, opsrc(desc, 2));
+		} else
+		{
+			translateSrc(o.src[1], (w>>10) & 0x7F, idx, opsrc(desc, 1));
+			translateSrc(o.src[2], (w>>5) & 0x1F, 0, opsrc(desc, 2));
+		}
+	} else
+	{
+		bool inverted = true;
+		switch (o.op)
+		{
+			case MAESTRO_DPHI: o.op = MAESTRO_DPH; break;
+			case MAESTRO_DSTI: o.op = MAESTRO_DST; break;
+			case MAESTRO_SGEI: o.op = MAESTRO_SGE; break;
+			case MAESTRO_SLTI: o.op = MAESTRO_SLT; break;
+			case MAESTRO_CMP+1: o.op = MAESTRO_CMP; inverted = false; break;
+			default: inverted = false; break;
+		}
+
+		int idx = (w>>19) & 3;
+		desc = opdescs[w & 0x7F];
+		o.dest = (w>>21) & 0x1F;
+		o.cmpx = (w>>24) & 7;
+		o.cmpy = (w>>21) & 7;
+		switch (o.op)
+		{
+			case MAESTRO_EX2:
+			case MAESTRO_LG2:
+			case MAESTRO_LITP:
+			case MAESTRO_FLR:
+			case MAESTRO_RCP:
+			case MAESTRO_RSQ:
+			case MAESTRO_MOV:
+			case MAESTRO_MOVA:
+				o.srcCount = 1;
+				break;
+			default:
+				o.srcCount = 2;
+				break;
+		}
+		if (inverted)
+		{
+			translateSrc(o.src[0], (w>>14) & 0x1F, 0, opsrc(desc, 0));
+			translateSrc(o.src[1], (w>>7) & 0x7F, idx, opsrc(desc, 1));
+		} else
+		{
+			translateSrc(o.src[0], (w>>12) & 0x7F, idx, opsrc(desc, 0));
+			translateSrc(o.src[1], (w>>7) & 0x1F, 0, opsrc(desc, 1));
+		}
+	}
+
+	o.mask = desc & 0xF;
+}
+
+const SimCode& SimTranslate(const SimProgram& prog)
+{
+	std::map<u64, SimCode>::iterator it = simCodeCache.find(prog.hash);
+	if (it != simCodeCache.end())
+		return it->second;
+
+	SimCode& code = simCodeCache[prog.hash];
+	code.resize(prog.code.size());
+	for (size_t i = 0; i < prog.code.size(); i ++)
+		translateInsn(prog.code[i], prog.opdescs, code[i]);
+	return code;
+}
+
+// --------------------------------------------------------------------
+// Batch interpreter
+// --------------------------------------------------------------------
+
+// Lanes are tracked with bit masks; inactive lanes skip instructions the same
+// way a single vertex would skip them in SimRun
+struct SimBatchEntry
+{
+	size_t finalPc, returnPc, loopPc;
+	int repeat, increment;
+	bool isLoop;
+	u32 restoreMask; // Lanes active once the block is left
+	u32 loopMask;    // Lanes still running the loop (FOR)
+	bool hasElse;    // ELSE section pending for other lanes (IFC)
+	size_t elseStart, elseFinal;
+	u32 elseMask;
+};
+
+struct SimBatchContext
+{
+	const SimCode* code;
+	const SimJitCode* jit; // NULL unless native code is used
+	const SimInputs* in;
+	SimBatch* batch;
+
+	float r[16][4][SIM_LANES];
+	int a0[2][SIM_LANES], aL[SIM_LANES];
+	u32 cmp[2];
+
+	SimBatchEntry stack[SIM_MAX_STACK];
+	int stackPos;
+	size_t pc;
+	u32 mask, fullMask;
+
+	int emitVertex[SIM_LANES];
+	bool emitPrim[SIM_LANES], emitWinding[SIM_LANES];
+	u64 insnCount, cycleCount;
+};
+
+typedef float simLanes[SIM_LANES];
+
+#define SIM_ALL_LANES ((u32)((1ULL << SIM_LANES) - 1))
+
+// Result code used when lanes take different jumps
+#define SIM_DIVERGED 2
+
+static inline int laneCount(u32 mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask-1)
+		n ++;
+	return n;
+}
+
+// Gets the lanes of each component of a source operand, pointing straight into
+// the register file when the operand is not negated
+static void readSrcBatch(SimBatchContext& ctx, const SimOpSrc& s, simLanes tmp[4], const float* out[4])
+{
+	if (s.reg < 0x20)
+	{
+		simLanes* vec = s.reg < 0x10 ? ctx.batch->v[s.reg] : ctx.r[s.reg-0x10];
+		for (int k = 0; k < 4; k ++)
+		{
+			const float* x = vec[s.sw[k]];
+			if (s.neg)
+			{
+				for (int l = 0; l < SIM_LANES; l ++)
+					tmp[k][l] = -x[l];
+				x = tmp[k];
+			}
+			out[k] = x;
+		}
+	} else if (!s.idx)
+	{
+		// Uniforms are the same for every lane
+		const float* vec = ctx.in->c[s.reg-0x20];
+		for (int k = 0; k < 4; k ++)
+		{
+			float x = vec[s.sw[k]];
+			if (s.neg) x = -x;
+			for (int l = 0; l < SIM_LANES; l ++)
+				tmp[k][l] = x;
+			out[k] = tmp[k];
+		}
+	} else
+	{
+		const int* offset = s.idx == 3 ? ctx.aL : ctx.a0[s.idx-1];
+		for (int l = 0; l < SIM_LANES; l ++)
+		{
+			int n = s.reg - 0x20 + offset[l];
+			const float* vec = n >= 0 && n < 96 ? ctx.in->c[n] : simOne;
+			for (int k = 0; k < 4; k ++)
+			{
+				float x = vec[s.sw[k]];
+				tmp[k][l] = s.neg ? -x : x;
+			}
+		}
+		for (int k = 0; k < 4; k ++)
+			out[k] = tmp[k];
+	}
+}
+
+static inline void dotBatch(simLanes res[4], const float* s1[4], const float* s2[4], int n, bool homogeneous)
+{
+	for (int l = 0; l < SIM_LANES; l ++)
+	{
+		float x = simMul(s1[0][l], s2[0][l]);
+		for (int k = 1; k < n; k ++)
+			x += simMul(s1[k][l], s2[k][l]);
+		if (homogeneous)
+			x += s2[3][l];
+		res[0][l] = res[1][l] = res[2][l] = res[3][l] = x;
+	}
+}
+
+static int execAluBatch(SimBatchContext& ctx, const SimOp& o)
+{
+	simLanes t1[4], t2[4], t3[4], res[4];
+	const float *s1[4], *s2[4], *s3[4];
+
+	if (o.srcCount > 0) readSrcBatch(ctx, o.src[0], t1, s1);
+	if (o.srcCount > 1) readSrcBatch(ctx, o.src[1], t2, s2);
+	if (o.srcCount > 2) readSrcBatch(ctx, o.src[2], t3, s3);
+
+	switch (o.op)
+	{
+		case MAESTRO_ADD:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = s1[k][l] + s2[k][l];
+			break;
+		case MAESTRO_MUL:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = simMul(s1[k][l], s2[k][l]);
+			break;
+		case MAESTRO_DP3:
+			dotBatch(res, s1, s2, 3, false);
+			break;
+		case MAESTRO_DP4:
+			dotBatch(res, s1, s2, 4, false);
+			break;
+		case MAESTRO_DPH:
+			dotBatch(res, s1, s2, 3, true);
+			break;
+		case MAESTRO_DST:
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				res[0][l] = 1.0f;
+				res[1][l] = simMul(s1[1][l], s2[1][l]);
+				res[2][l] = s1[2][l];
+				res[3][l] = s2[3][l];
+			}
+			break;
+		case MAESTRO_EX2:
+			for (int l = 0; l < SIM_LANES; l ++)
+				res[0][l] = res[1][l] = res[2][l] = res[3][l] = exp2f(s1[0][l]);
+			break;
+		case MAESTRO_LG2:
+			for (int l = 0; l < SIM_LANES; l ++)
+				res[0][l] = res[1][l] = res[2][l] = res[3][l] = log2f(s1[0][l]);
+			break;
+		case MAESTRO_LITP:
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				res[0][l] = std::max(s1[0][l], 0.0f);
+				res[1][l] = std::min(std::max(s1[1][l], -127.9961f), 127.9961f);
+				res[2][l] = s1[2][l];
+				res[3][l] = std::max(s1[3][l], 0.0f);
+			}
+			break;
+		case MAESTRO_SGE:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = s1[k][l] >= s2[k][l] ? 1.0f : 0.0f;
+			break;
+		case MAESTRO_SLT:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = s1[k][l] < s2[k][l] ? 1.0f : 0.0f;
+			break;
+		case MAESTRO_FLR:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = floorf(s1[k][l]);
+			break;
+		case MAESTRO_MAX:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = s1[k][l] > s2[k][l] ? s1[k][l] : s2[k][l];
+			break;
+		case MAESTRO_MIN:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = s1[k][l] < s2[k][l] ? s1[k][l] : s2[k][l];
+			break;
+		case MAESTRO_RCP:
+			for (int l = 0; l < SIM_LANES; l ++)
+				res[0][l] = res[1][l] = res[2][l] = res[3][l] = 1.0f / s1[0][l];
+			break;
+		case MAESTRO_RSQ:
+			for (int l = 0; l < SIM_LANES; l ++)
+				res[0][l] = res[1][l] = res[2][l] = res[3][l] = 1.0f / sqrtf(s1[0][l]);
+			break;
+		case MAESTRO_MOV:
+			for (int k = 0; k < 4; k ++)
+				memcpy(res[k], s1[k], sizeof(res[k]));
+			break;
+		case MAESTRO_MOVA:
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				if (!(ctx.mask & BIT(l))) continue;
+				if (o.mask & BIT(3)) ctx.a0[0][l] = (int)s1[0][l];
+				if (o.mask & BIT(2)) ctx.a0[1][l] = (int)s1[1][l];
+			}
+			return 0;
+		case MAESTRO_MAD:
+			for (int k = 0; k < 4; k ++)
+				for (int l = 0; l < SIM_LANES; l ++)
+					res[k][l] = simMul(s1[k][l], s2[k][l]) + s3[k][l];
+			break;
+		case MAESTRO_CMP:
+		{
+			u32 x = 0, y = 0;
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				x |= compare(o.cmpx, s1[0][l], s2[0][l]) << l;
+				y |= compare(o.cmpy, s1[1][l], s2[1][l]) << l;
+			}
+			ctx.cmp[0] = (ctx.cmp[0] &~ ctx.mask) | (x & ctx.mask);
+			ctx.cmp[1] = (ctx.cmp[1] &~ ctx.mask) | (y & ctx.mask);
+			return 0;
+		}
+		default:
+			return simError("unknown opcode 0x%02X at %u\n", o.op, (unsigned)ctx.pc);
+	}
+
+	simLanes* tgt = o.dest < 0x10 ? ctx.batch->o[o.dest] : ctx.r[o.dest-0x10];
+	for (int k = 0; k < 4; k ++)
+	{
+		if (!(o.mask & BIT(3-k)))
+			continue;
+		if (ctx.mask == SIM_ALL_LANES)
+		{
+			for (int l = 0; l < SIM_LANES; l ++)
+				tgt[k][l] = f24round(res[k][l]);
+		} else
+		{
+			for (int l = 0; l < SIM_LANES; l ++)
+				if (ctx.mask & BIT(l))
+					tgt[k][l] = f24round(res[k][l]);
+		}
+	}
+	return 0;
+}
+
+// Returns the lanes for which the condition holds
+static inline u32 evalCondBatch(SimBatchContext& ctx, u32 w)
+{
+	u32 x = (w>>25) & 1 ? ctx.cmp[0] : ~ctx.cmp[0];
+	u32 y = (w>>24) & 1 ? ctx.cmp[1] : ~ctx.cmp[1];
+	switch ((w>>22) & 3)
+	{
+		case 0: return (x | y) & ctx.mask;
+		case 1: return (x & y) & ctx.mask;
+		case 2: return x & ctx.mask;
+		default: return y & ctx.mask;
+	}
+}
+
+static int pushBlockBatch(SimBatchContext& ctx, size_t start, size_t num, size_t ret, u32 mask)
+{
+	if (ctx.stackPos == SIM_MAX_STACK)
+		return simError("stack overflow at %u\n", (unsigned)ctx.pc);
+
+	SimBatchEntry& e = ctx.stack[ctx.stackPos++];
+	memset(&e, 0, sizeof(e));
+	e.finalPc = start + num;
+	e.returnPc = ret;
+	e.loopPc = start;
+	e.restoreMask = ctx.mask;
+	ctx.mask = mask;
+	ctx.pc = start;
+	return 0;
+}
+
+// Removes lanes from the blocks above the given stack level
+static void dropLanes(SimBatchContext& ctx, int level, u32 lanes)
+{
+	for (int i = level; i < ctx.stackPos; i ++)
+	{
+		ctx.stack[i].restoreMask &= ~lanes;
+		ctx.stack[i].elseMask &= ~lanes;
+		ctx.stack[i].loopMask &= ~lanes;
+	}
+	ctx.mask &= ~lanes;
+}
+
+// Leaves the current block, or continues with its pending ELSE section
+static void leaveBlock(SimBatchContext& ctx)
+{
+	SimBatchEntry& e = ctx.stack[ctx.stackPos-1];
+	if (e.hasElse && e.elseMask)
+	{
+		e.hasElse = false;
+		e.finalPc = e.elseFinal;
+		ctx.pc = e.elseStart;
+		ctx.mask = e.elseMask;
+		return;
+	}
+
+	ctx.pc = e.returnPc;
+	ctx.mask = e.restoreMask;
+	ctx.stackPos--;
+}
+
+static int execFlowBatch(SimBatchContext& ctx, u32 w)
+{
+	int op = w >> 26;
+	size_t dst = (w>>10) & 0xFFF, num = w & 0x3FF;
+	u32 taken;
+
+	switch (op)
+	{
+		case MAESTRO_NOP:
+			break;
+		case MAESTRO_END:
+			// Lanes which reach END are done
+			dropLanes(ctx, 0, ctx.mask);
+			return 0;
+		case MAESTRO_BREAK:
+		case MAESTRO_BREAKC:
+		{
+			taken = op == MAESTRO_BREAKC ? evalCondBatch(ctx, w) : ctx.mask;
+			if (!taken)
+				break;
+			int loop = ctx.stackPos-1;
+			while (loop >= 0 && !ctx.stack[loop].isLoop)
+				loop --;
+			if (loop < 0)
+				return simError("break outside of a loop at %u\n", (unsigned)ctx.pc);
+			// The lanes become active again once the loop is left
+			dropLanes(ctx, loop+1, taken);
+			ctx.stack[loop].loopMask &= ~taken;
+			break;
+		}
+		case MAESTRO_CALL:
+		case MAESTRO_CALLC:
+		case MAESTRO_CALLU:
+			if (op == MAESTRO_CALL)
+				taken = ctx.mask;
+			else if (op == MAESTRO_CALLC)
+				taken = evalCondBatch(ctx, w);
+			else
+				taken = ctx.in->b[(w>>22) & 0xF] ? ctx.mask : 0;
+			if (!taken)
+				break;
+			return pushBlockBatch(ctx, dst, num, ctx.pc+1, taken);
+		case MAESTRO_IFU:
+		case MAESTRO_IFC:
+		{
+			if (op == MAESTRO_IFU)
+				taken = ctx.in->b[(w>>22) & 0xF] ? ctx.mask : 0;
+			else
+				taken = evalCondBatch(ctx, w);
+			u32 notTaken = ctx.mask &~ taken;
+			if (!taken)
+				return pushBlockBatch(ctx, dst, num, dst+num, ctx.mask);
+			safe_call(pushBlockBatch(ctx, ctx.pc+1, dst-ctx.pc-1, dst+num, taken));
+			if (notTaken)
+			{
+				SimBatchEntry& e = ctx.stack[ctx.stackPos-1];
+				e.hasElse = true;
+				e.elseStart = dst;
+				e.elseFinal = dst+num;
+				e.elseMask = notTaken;
+			}
+			return 0;
+		}
+		case MAESTRO_FOR:
+		{
+			const u8* i = ctx.in->i[(w>>22) & 3];
+			for (int l = 0; l < SIM_LANES; l ++)
+				if (ctx.mask & BIT(l))
+					ctx.aL[l] = i[1];
+			safe_call(pushBlockBatch(ctx, ctx.pc+1, dst-ctx.pc, dst+1, ctx.mask));
+			SimBatchEntry& e = ctx.stack[ctx.stackPos-1];
+			e.repeat = i[0];
+			e.increment = i[2];
+			e.isLoop = true;
+			e.loopMask = ctx.mask;
+			return 0;
+		}
+		case MAESTRO_EMIT:
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				if (!(ctx.mask & BIT(l))) continue;
+				SimEmit e;
+				for (int j = 0; j < 16; j ++)
+					for (int k = 0; k < 4; k ++)
+						e.o[j][k] = ctx.batch->o[j][k][l];
+				e.vertexId = ctx.emitVertex[l];
+				e.primEmit = ctx.emitPrim[l];
+				e.winding = ctx.emitWinding[l];
+				ctx.batch->emitted[l].push_back(e);
+			}
+			break;
+		case MAESTRO_SETEMIT:
+			for (int l = 0; l < SIM_LANES; l ++)
+			{
+				if (!(ctx.mask & BIT(l))) continue;
+				ctx.emitWinding[l] = (w>>22) & 1;
+				ctx.emitPrim[l] = (w>>23) & 1;
+				ctx.emitVertex[l] = (w>>24) & 3;
+			}
+			break;
+		case MAESTRO_JMPC:
+		case MAESTRO_JMPU:
+			if (op == MAESTRO_JMPC)
+				taken = evalCondBatch(ctx, w);
+			else
+				taken = ctx.in->b[(w>>22) & 0xF] == !(w & 1) ? ctx.mask : 0;
+			if (!taken)
+				break;
+			if (taken != ctx.mask)
+				return SIM_DIVERGED;
+			ctx.pc = dst;
+			return 0;
+	}
+
+	ctx.pc ++;
+	return 0;
+}
+
+static int runBatch(SimBatchContext& ctx)
+{
+	u64 steps = 0;
+	for (;;)
+	{
+		// Lanes which broke out of every active block or ended
+		while (!ctx.mask)
+		{
+			if (!ctx.stackPos)
+				return 0;
+			leaveBlock(ctx);
+		}
+
+		// Leave finished blocks, repeating loops as needed
+		if (ctx.stackPos && ctx.pc == ctx.stack[ctx.stackPos-1].finalPc)
+		{
+			SimBatchEntry& e = ctx.stack[ctx.stackPos-1];
+			if (e.isLoop)
+			{
+				for (int l = 0; l < SIM_LANES; l ++)
+					if (e.loopMask & BIT(l))
+						ctx.aL[l] = (ctx.aL[l] + e.increment) & 0xFF;
+				if (e.repeat && e.loopMask)
+				{
+					e.repeat--;
+					ctx.pc = e.loopPc;
+					ctx.mask = e.loopMask;
+					continue;
+				}
+			}
+			leaveBlock(ctx);
+			continue;
+		}
+
+		if (ctx.pc >= ctx.code->size())
+			return simError("program counter out of range: %u\n", (unsigned)ctx.pc);
+
+		// Native code only runs with every lane of the batch active
+		if (ctx.jit && ctx.mask == ctx.fullMask && ctx.jit->entry[ctx.pc])
+		{
+			size_t n = ctx.jit->length[ctx.pc];
+			if ((steps += n) > g_simMaxSteps)
+				return simError("step limit exceeded (%llu instructions)\n", (unsigned long long)g_simMaxSteps);
+			ctx.jit->entry[ctx.pc](&ctx.r[0][0][0], &ctx.batch->v[0][0][0], &ctx.batch->o[0][0][0], &ctx.in->c[0][0]);
+			ctx.insnCount += n * laneCount(ctx.mask);
+			for (size_t i = 0; g_simLatency && i < n; i ++)
+				ctx.cycleCount += laneCount(ctx.mask) * g_simLatency[(*ctx.code)[ctx.pc+i].word >> 26];
+			ctx.pc += n;
+			continue;
+		}
+
+		if (++steps > g_simMaxSteps)
+			return simError("step limit exceeded (%llu instructions)\n", (unsigned long long)g_simMaxSteps);
+
+		const SimOp& o = (*ctx.code)[ctx.pc];
+		u32 w = o.word;
+		int op = w >> 26;
+		if (g_simTrace)
+			fprintf(stderr, "%4u: %08X [%08X]\n", (unsigned)ctx.pc, w, ctx.mask);
+		ctx.insnCount += laneCount(ctx.mask);
+		if (g_simLatency)
+			ctx.cycleCount += laneCount(ctx.mask) * g_simLatency[op];
+
+		if (op < 0x20 || op >= MAESTRO_CMP)
+		{
+			safe_call(execAluBatch(ctx, o));
+			ctx.pc ++;
+		} else
+			safe_call(execFlowBatch(ctx, w));
+	}
+}
+
+// Runs one vertex of the batch with SimRun
+static int runLane(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch& batch, int l, SimStats* stats)
+{
+	SimInputs laneIn = in;
+	for (int j = 0; j < 16; j ++)
+		for (int k = 0; k < 4; k ++)
+			laneIn.v[j][k] = batch.v[j][k][l];
+
+	SimOutputs out;
+	safe_call(SimRun(prog, dvle, laneIn, out, stats));
+
+	for (int j = 0; j < 16; j ++)
+		for (int k = 0; k < 4; k ++)
+			batch.o[j][k][l] = out.o[j][k];
+	batch.emitted[l].swap(out.emitted);
+	return 0;
+}
+
+int SimRunBatch(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch& batch, SimStats* stats)
+{
+	if (batch.count < 0 || batch.count > SIM_LANES)
+		return simError("invalid batch size: %d\n", batch.count);
+
+	// Profiles are only collected by SimRun
+	if (g_simScalar || (stats && !stats->profile.empty()))
+	{
+		for (int l = 0; l < batch.count; l ++)
+			safe_call(runLane(prog, dvle, in, batch, l, stats));
+		return 0;
+	}
+
+	SimBatchContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.code = &SimTranslate(prog);
+	ctx.jit = g_simTrace ? NULL : SimCompile(prog);
+	ctx.in = &in;
+	ctx.batch = &batch;
+	ctx.pc = dvle.entryStart;
+	ctx.mask = ctx.fullMask = (u32)((1ULL << batch.count) - 1);
+	memset(batch.o, 0, sizeof(batch.o));
+	for (int l = 0; l < SIM_LANES; l ++)
+		batch.emitted[l].clear();
+
+	int rc = runBatch(ctx);
+
+	if (rc == SIM_DIVERGED)
+	{
+		// Lanes took different jumps, run them one at a time instead
+		if (stats)
+			stats->scalarFallbacks ++;
+		for (int l = 0; l < batch.count; l ++)
+			safe_call(runLane(prog, dvle, in, batch, l, stats));
+		return 0;
+	}
+
+	if (rc == 0 && stats)
+	{
+		stats->insnCount += ctx.insnCount;
+		stats->cycleCount += ctx.cycleCount;
+		stats->vertexCount += batch.count;
+	}
+	return rc;
+}
+
+// --------------------------------------------------------------------
+// Dispatcher
+// --------------------------------------------------------------------
+
+// Each worker owns a range of batches and runs it from the front; once it is
+// empty the worker steals the back half of the range of another worker
+struct SimWorker
+{
+	struct SimDispatch* d;
+	size_t head, tail;
+	SimStats stats;
+	int rc;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_t thread;
+#endif
+};
+
+struct SimDispatch
+{
+	const SimProgram* prog;
+	const SimDvle* dvle;
+	const SimInputs* in;
+	SimBatch* batches;
+	SimWorker workers[SIM_MAX_THREADS];
+	int count;
+};
+
+#ifdef HAVE_PTHREAD
+static bool stealBatches(SimWorker& w)
+{
+	SimDispatch& d = *w.d;
+	int self = &w - d.workers;
+	for (int i = 1; i < d.count; i ++)
+	{
+		SimWorker& v = d.workers[(self + i) % d.count];
+		pthread_mutex_lock(&v.lock);
+		size_t left = v.tail - v.head;
+		size_t end = v.tail;
+		if (left)
+			v.tail -= (left + 1) / 2;
+		size_t start = v.tail;
+		pthread_mutex_unlock(&v.lock);
+
+		if (start != end)
+		{
+			pthread_mutex_lock(&w.lock);
+			w.head = start;
+			w.tail = end;
+			pthread_mutex_unlock(&w.lock);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool nextBatch(SimWorker& w, size_t& batch)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&w.lock);
+		bool found = w.head < w.tail;
+		if (found)
+			batch = w.head++;
+		pthread_mutex_unlock(&w.lock);
+		if (found)
+			return true;
+		if (!stealBatches(w))
+			return false;
+	}
+}
+
+static void* workerMain(void* arg)
+{
+	SimWorker& w = *(SimWorker*)arg;
+	SimDispatch& d = *w.d;
+	size_t batch;
+	while (!w.rc && nextBatch(w, batch))
+		w.rc = SimRunBatch(*d.prog, *d.dvle, *d.in, d.batches[batch], &w.stats);
+	return NULL;
+}
+
+static int runThreaded(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch* batches, size_t count, int threads, SimStats* stats)
+{
+	// Translate the program up front, the caches are not thread safe
+	SimTranslate(prog);
+	SimCompile(prog);
+
+	SimDispatch* d = new SimDispatch;
+	d->prog = &prog;
+	d->dvle = &dvle;
+	d->in = &in;
+	d->batches = batches;
+	d->count = threads;
+
+	for (int i = 0; i < threads; i ++)
+	{
+		SimWorker& w = d->workers[i];
+		w.d = d;
+		w.head = count * i / threads;
+		w.tail = count * (i+1) / threads;
+		w.rc = 0;
+		if (stats)
+			w.stats.profile.resize(stats->profile.size());
+		pthread_mutex_init(&w.lock, NULL);
+	}
+
+	// The batches of workers which fail to start are stolen by the others
+	int started = 0;
+	while (started < threads && pthread_create(&d->workers[started].thread, NULL, workerMain, &d->workers[started]) == 0)
+		started ++;
+
+	int rc = 0;
+	if (!started)
+		for (size_t i = 0; !rc && i < count; i ++)
+			rc = SimRunBatch(prog, dvle, in, batches[i], stats);
+
+	for (int i = 0; i < started; i ++)
+	{
+		SimWorker& w = d->workers[i];
+		pthread_join(w.thread, NULL);
+		if (!rc)
+			rc = w.rc;
+		if (stats)
+			stats->add(w.stats);
+	}
+	for (int i = 0; i < threads; i ++)
+		pthread_mutex_destroy(&d->workers[i].lock);
+
+	delete d;
+	return rc;
+}
+#endif
+
+int SimRunBatches(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch* batches, size_t count, int threads, SimStats* stats)
+{
+#ifdef HAVE_PTHREAD
+	threads = std::min(threads, SIM_MAX_THREADS);
+	if ((size_t)threads > count)
+		threads = count;
+	if (threads > 1)
+		return runThreaded(prog, dvle, in, batches, count, threads, stats);
+#endif
+
+	for (size_t i = 0; i < count; i ++)
+		safe_call(SimRunBatch(prog, dvle, in, batches[i], stats));
+	return 0;
+}
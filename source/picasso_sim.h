@@ -0,0 +1,202 @@
+#pragma once
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "picasso.h"
+
+//-----------------------------------------------------------------------------
+// Host-side PICA200 shader simulator
+//-----------------------------------------------------------------------------
+
+// Register numbers follow the assembler's numbering:
+//   0x00..0x0F v0-v15 (inputs), 0x20..0x7F c0-c95,
+//   0x80..0x83 i0-i3, 0x88..0x97 b0-b15
+struct SimSymbol
+{
+	std::string name;
+	int reg, size;
+};
+
+struct SimDvle
+{
+	bool isGeoShader, isMerge;
+	size_t entryStart, entryEnd;
+	u16 inputMask, outputMask;
+	u8 geoShaderType;
+	u8 geoShaderFixedStart;
+	u8 geoShaderVariableNum;
+	u8 geoShaderFixedNum;
+	std::vector<Constant> constants;
+	std::vector<u64> outputs;
+	std::vector<SimSymbol> symbols;
+
+	const SimSymbol* findSymbol(const char* name) const
+	{
+		for (size_t i = 0; i < symbols.size(); i ++)
+			if (symbols[i].name == name)
+				return &symbols[i];
+		return NULL;
+	}
+};
+
+struct SimProgram
+{
+	std::vector<u32> code;
+	std::vector<u32> opdescs;
+	std::vector<SimDvle> dvles;
+	u64 hash; // Identifies the code and opdescs (set by SimLoadShbin)
+
+	SimProgram() : hash(0) { }
+};
+
+struct SimOpSrc
+{
+	u8 reg, idx, neg;
+	u8 sw[4]; // Component read for each component
+};
+
+// Instruction translated for SimRunBatch, with its operand descriptor applied
+struct SimOp
+{
+	u32 word;      // Original instruction word
+	u8 op;         // MAESTRO_* opcode, inverted forms folded into the normal ones
+	u8 dest, mask; // Destination register and write mask (bit 3 = x)
+	u8 cmpx, cmpy;
+	u8 srcCount;
+	SimOpSrc src[3];
+};
+
+typedef std::vector<SimOp> SimCode;
+
+// Values of the input and uniform registers
+struct SimInputs
+{
+	float v[16][4];
+	float c[96][4];
+	u8 i[4][4];
+	bool b[16];
+
+	SimInputs() { memset(this, 0, sizeof(*this)); }
+};
+
+// Vertex emitted by a geometry shader
+struct SimEmit
+{
+	float o[16][4];
+	int vertexId;
+	bool primEmit, winding;
+};
+
+struct SimOutputs
+{
+	float o[16][4];
+	std::vector<SimEmit> emitted;
+};
+
+// Number of vertices processed together by SimRunBatch (up to 32)
+#ifndef SIM_LANES
+#define SIM_LANES 8
+#endif
+
+// Batch of vertices in SoA layout (register, component, vertex)
+struct SimBatch
+{
+	int count; // Vertices in the batch
+	float v[16][4][SIM_LANES];
+	float o[16][4][SIM_LANES];
+	std::vector<SimEmit> emitted[SIM_LANES];
+
+	SimBatch() : count(0) { memset(v, 0, sizeof(v)); memset(o, 0, sizeof(o)); }
+};
+
+// Native code for runs of ALU instructions in the batch path, only generated
+// on x86-64 hosts (see picasso_simjit.cpp)
+#if defined(__x86_64__) && !defined(_WIN32) && defined(HAVE_MMAP) && SIM_LANES % 4 == 0
+#define SIM_HAVE_JIT
+#endif
+
+// Runs the instructions on all lanes of a batch: temporary registers, inputs,
+// outputs and float uniforms
+typedef void (*SimJitFunc)(float* r, const float* v, float* o, const float* c);
+
+struct SimJitCode
+{
+	std::vector<SimJitFunc> entry; // By program counter, NULL if no run starts there
+	std::vector<size_t> length;    // Instructions in the run
+	size_t size;                   // Bytes of native code
+
+	SimJitCode() : size(0) { }
+};
+
+// Execution counts of one program word, summed over all vertices
+struct SimProfileEntry
+{
+	u64 count;
+	u64 taken, notTaken; // Conditional flow instructions
+	u64 loops, trips;    // FOR: loops entered and iterations started
+	int maxDepth;        // Deepest call nesting the word ran at
+
+	SimProfileEntry() : count(0), taken(0), notTaken(0), loops(0), trips(0), maxDepth(0) { }
+
+	void add(const SimProfileEntry& rhs)
+	{
+		count += rhs.count;
+		taken += rhs.taken;
+		notTaken += rhs.notTaken;
+		loops += rhs.loops;
+		trips += rhs.trips;
+		maxDepth = std::max(maxDepth, rhs.maxDepth);
+	}
+};
+
+struct SimStats
+{
+	u64 insnCount;      // Instructions executed, summed over all vertices
+	u64 cycleCount;     // Cycles taken by them, when g_simLatency is set
+	u64 vertexCount;
+	u64 scalarFallbacks; // Batches rerun one vertex at a time
+	std::vector<SimProfileEntry> profile; // By program counter, empty unless profiling
+
+	SimStats() : insnCount(0), cycleCount(0), vertexCount(0), scalarFallbacks(0) { }
+
+	void add(const SimStats& rhs)
+	{
+		insnCount += rhs.insnCount;
+		cycleCount += rhs.cycleCount;
+		vertexCount += rhs.vertexCount;
+		scalarFallbacks += rhs.scalarFallbacks;
+		if (profile.size() < rhs.profile.size())
+			profile.resize(rhs.profile.size());
+		for (size_t i = 0; i < rhs.profile.size(); i ++)
+			profile[i].add(rhs.profile[i]);
+	}
+};
+
+// Source line table written by picasso --line-table
+struct SimLineTable
+{
+	std::vector<std::string> files;
+	std::vector<std::string> procs;
+	std::vector<SourceLoc> locs; // By program counter, file -1 if unknown
+	std::vector<int> owners;     // Procedure of each program counter, or -1
+};
+
+#define SIM_MAX_STACK 16
+#define SIM_MAX_THREADS 64
+#define SIM_DEFAULT_MAX_STEPS 1000000
+
+extern u64 g_simMaxSteps;
+extern bool g_simTrace;
+extern bool g_simScalar; // Makes SimRunBatch run one vertex at a time
+extern bool g_simJit;    // Lets SimRunBatch run native code where possible
+extern const int* g_simLatency; // Cycles of each opcode, NULL to not count cycles
+
+int SimLoadShbin(const char* filename, SimProgram& prog);
+int SimLoadLineTable(const char* filename, SimLineTable& table);
+void SimApplyConstants(const SimDvle& dvle, SimInputs& in);
+int SimRun(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimOutputs& out, SimStats* stats);
+const SimCode& SimTranslate(const SimProgram& prog);
+const SimJitCode* SimCompile(const SimProgram& prog);
+int SimRunBatch(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch& batch, SimStats* stats);
+int SimRunBatches(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, SimBatch* batches, size_t count, int threads, SimStats* stats);
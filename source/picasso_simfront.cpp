@@ -0,0 +1,913 @@
+#include "picasso_sim.h"
+
+static const char* const outTypeNames[] =
+{
+	"pos", "nquat", "clr", "tcoord0", "tcoord0w", "tcoord1", "tcoord2", "?", "view", "dummy",
+};
+
+int usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] file.shbin\n"
+		"Options:\n"
+		"  -e, --entry=<n>         Specifies the DVLE to run (default 0)\n"
+		"  -s, --set=<reg>=<vals>  Sets an input or uniform register (v0, c3, i0, b1 or a uniform name)\n"
+		"  -f, --file=<file>       Reads register assignments from a file, one per line\n"
+		"  -i, --inputs=<file>     Runs a stream of vertices, one line of input assignments each\n"
+		"  -S, --scalar            Runs vertex streams one vertex at a time instead of in batches\n"
+		"  -J, --no-jit            Runs batches without generating native code\n"
+		"  -q, --quiet             Only prints statistics\n"
+		"  -b, --bench=<n>         Times the interpreter, the batch path and native code over n runs of the vertex stream\n"
+		"  -j, --jobs=<n>          Runs vertex streams on n threads (default 1)\n"
+		"  -p, --profile=<file>    Writes execution counts for each program word to a file\n"
+		"  -a, --annotate          Prints the source annotated with execution counts\n"
+		"  -l, --lines=<file>      Reads the line table written by picasso --line-table\n"
+		"  -c, --compare=<file>    Runs the vertex stream through a second SHBIN file and compares the results\n"
+		"  -T, --tolerance=<n>     Specifies how many f24 ulps compared outputs may differ by (default 1)\n"
+		"  -L, --latency=<file>    Reads the cycle count of each instruction, and counts cycles\n"
+		"  -m, --max-steps=<n>     Specifies the maximum number of executed instructions\n"
+		"  -t, --trace             Traces executed instructions to stderr\n"
+		"  -v, --version           Displays version information\n"
+		, prog);
+	return EXIT_FAILURE;
+}
+
+// Resolves a register or uniform name (optionally indexed) to a register number
+static int parseTarget(const SimDvle& dvle, char* name, int& reg)
+{
+	int index = 0;
+	char* br = strchr(name, '[');
+	if (br)
+	{
+		char* endptr = NULL;
+		index = strtol(br+1, &endptr, 0);
+		if (*endptr != ']' || endptr[1] || index < 0)
+		{
+			fprintf(stderr, "error: invalid index: %s\n", name);
+			return 1;
+		}
+		*br = 0;
+	}
+
+	const SimSymbol* sym = dvle.findSymbol(name);
+	if (sym)
+	{
+		if (index >= sym->size)
+		{
+			fprintf(stderr, "error: index out of range: %s[%d]\n", name, index);
+			return 1;
+		}
+		reg = sym->reg + index;
+		return 0;
+	}
+
+	static const struct { char letter; int base, count; } regTypes[] =
+	{
+		{ 'v', 0x00, 16 }, { 'c', 0x20, 96 }, { 'i', 0x80, 4 }, { 'b', 0x88, 16 },
+	};
+
+	char* endptr = NULL;
+	int n = strtol(name+1, &endptr, 10);
+	for (int i = 0; i < 4; i ++)
+	{
+		if (tolower(name[0]) != regTypes[i].letter || endptr == name+1 || *endptr)
+			continue;
+		n += index;
+		if (n < 0 || n >= regTypes[i].count)
+			break;
+		reg = regTypes[i].base + n;
+		return 0;
+	}
+
+	fprintf(stderr, "error: unknown register or uniform: %s\n", name);
+	return 1;
+}
+
+// Parses an assignment of the form <reg>=<x>[,<y>[,<z>[,<w>]]]
+static int parseAssignment(const SimDvle& dvle, SimInputs& in, char* str, bool inputsOnly = false)
+{
+	// Remove whitespace
+	char* dst = str;
+	for (char* src = str; *src; src ++)
+		if (!isspace((unsigned char)*src))
+			*dst++ = *src;
+	*dst = 0;
+
+	char* eq = strchr(str, '=');
+	if (!eq)
+	{
+		fprintf(stderr, "error: invalid assignment: %s\n", str);
+		return 1;
+	}
+	*eq = 0;
+
+	int reg = 0;
+	safe_call(parseTarget(dvle, str, reg));
+	if (inputsOnly && reg >= 0x10)
+	{
+		fprintf(stderr, "error: only input registers can be set per vertex: %s\n", str);
+		return 1;
+	}
+
+	char* val = eq+1;
+	for (int k = 0; k < 4 && *val; k ++)
+	{
+		char* endptr = NULL;
+		if (reg >= 0x88)
+		{
+			bool b;
+			if (stricmp(val, "true") == 0 || stricmp(val, "false") == 0)
+			{
+				b = tolower(*val) == 't';
+				endptr = val + strlen(val);
+			} else
+				b = strtol(val, &endptr, 0) != 0;
+			in.b[reg-0x88] = b;
+			k = 3;
+		} else if (reg >= 0x80)
+			in.i[reg-0x80][k] = strtol(val, &endptr, 0) & 0xFF;
+		else
+		{
+			float x = f24round(strtof(val, &endptr));
+			if (reg >= 0x20)
+				in.c[reg-0x20][k] = x;
+			else
+				in.v[reg][k] = x;
+		}
+
+		if (endptr == val || (*endptr && (*endptr != ',' || k == 3)))
+		{
+			fprintf(stderr, "error: invalid value: %s\n", val);
+			return 1;
+		}
+		val = *endptr ? endptr+1 : endptr;
+	}
+
+	return 0;
+}
+
+static int parseFile(const SimDvle& dvle, SimInputs& in, const char* filename)
+{
+	char* text = StringFromFile(filename);
+	if (!text)
+	{
+		fprintf(stderr, "error: cannot open input file: %s\n", filename);
+		return 1;
+	}
+
+	int rc = 0;
+	for (char* line = strtok(text, "\n"); line && !rc; line = strtok(NULL, "\n"))
+	{
+		char* comment = strchr(line, '#');
+		if (comment) *comment = 0;
+		char* p = line;
+		while (isspace((unsigned char)*p)) p ++;
+		if (*p)
+			rc = parseAssignment(dvle, in, p);
+	}
+
+	free(text);
+	return rc;
+}
+
+static void printOutputs(const SimDvle& dvle, float o[16][4], const char* indent)
+{
+	for (size_t i = 0; i < dvle.outputs.size(); i ++)
+	{
+		u64 x = dvle.outputs[i];
+		int type = x & 0xFFFF, reg = (x >> 16) & 0xF, mask = (x >> 32) & 0xF;
+		printf("%so%-2d %-8s =", indent, reg, type < 10 ? outTypeNames[type] : "?");
+		for (int k = 0; k < 4; k ++)
+		{
+			if (mask & BIT(k))
+				printf(" %12f", o[reg][k]);
+			else
+				printf(" %12s", "-");
+		}
+		printf("\n");
+	}
+}
+
+static void printBatch(const SimDvle& dvle, SimBatch& batch, u64 first)
+{
+	for (int l = 0; l < batch.count; l ++)
+	{
+		printf("vertex %llu:\n", (unsigned long long)(first + l));
+		if (dvle.isGeoShader)
+		{
+			for (size_t i = 0; i < batch.emitted[l].size(); i ++)
+			{
+				SimEmit& e = batch.emitted[l][i];
+				printf("  emit %u: vertex %d%s%s\n", (unsigned)i, e.vertexId, e.primEmit ? ", primitive" : "", e.winding ? ", inverted" : "");
+				printOutputs(dvle, e.o, "    ");
+			}
+			continue;
+		}
+
+		float o[16][4];
+		for (int j = 0; j < 16; j ++)
+			for (int k = 0; k < 4; k ++)
+				o[j][k] = batch.o[j][k][l];
+		printOutputs(dvle, o, "  ");
+	}
+}
+
+// Reads the next vertex of a stream file, returns 0 at the end of the file.
+// Lines starting with '@' update uniforms instead: they are returned in
+// update (to be applied with applyUpdate) with a result of 2
+static int nextVertex(FILE* f, const char* filename, int& lineNo, const SimDvle& dvle, SimInputs& vtx, std::string& update)
+{
+	char line[4096];
+	while (fgets(line, sizeof(line), f))
+	{
+		lineNo ++;
+		if (!strchr(line, '\n') && !feof(f))
+		{
+			fprintf(stderr, "%s:%d: error: line too long\n", filename, lineNo);
+			return -1;
+		}
+
+		char* comment = strchr(line, '#');
+		if (comment) *comment = 0;
+		char* p = line;
+		while (isspace((unsigned char)*p)) p ++;
+		if (!*p) continue;
+
+		if (*p == '@')
+		{
+			update = p+1;
+			return 2;
+		}
+
+		memset(vtx.v, 0, sizeof(vtx.v));
+		for (char* a = strtok(p, ";"); a; a = strtok(NULL, ";"))
+		{
+			if (parseAssignment(dvle, vtx, a, true) != 0)
+			{
+				fprintf(stderr, "%s:%d: error: invalid vertex\n", filename, lineNo);
+				return -1;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int applyUpdate(const SimDvle& dvle, SimInputs& in, const std::string& update, const char* filename, int lineNo)
+{
+	std::vector<char> text(update.begin(), update.end());
+	text.push_back(0);
+	for (char* a = strtok(&text[0], ";"); a; a = strtok(NULL, ";"))
+	{
+		if (parseAssignment(dvle, in, a) != 0)
+		{
+			fprintf(stderr, "%s:%d: error: invalid uniform update\n", filename, lineNo);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static FILE* openStream(const char* filename)
+{
+	FILE* f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (!f)
+		fprintf(stderr, "error: cannot open input file: %s\n", filename);
+	return f;
+}
+
+// Batches read from a vertex stream before they are run
+#define STREAM_BLOCK 1024
+
+static void setLane(SimBatch& batch, int l, float v[16][4])
+{
+	for (int j = 0; j < 16; j ++)
+		for (int k = 0; k < 4; k ++)
+			batch.v[j][k][l] = v[j][k];
+}
+
+// Runs every vertex of a stream file through the DVLE, in batches
+static int runStream(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, const char* filename, bool quiet, int jobs, SimStats& stats)
+{
+	FILE* f = openStream(filename);
+	if (!f)
+		return 1;
+
+	std::vector<SimBatch> block(STREAM_BLOCK);
+	SimInputs vtx, uniforms = in;
+	std::string update;
+	u64 first = 0;
+	int rc = 0, lineNo = 0;
+
+	do
+	{
+		// Vertices read before an update are run with the previous uniforms
+		size_t n = 0;
+		block[0].count = 0;
+		while (n < STREAM_BLOCK && (rc = nextVertex(f, filename, lineNo, dvle, vtx, update)) == 1)
+		{
+			SimBatch& batch = block[n];
+			setLane(batch, batch.count++, vtx.v);
+			if (batch.count == SIM_LANES && ++n < STREAM_BLOCK)
+				block[n].count = 0;
+		}
+		if (n < STREAM_BLOCK && block[n].count)
+			n ++;
+
+		if (rc >= 0 && n)
+		{
+			rc = SimRunBatches(prog, dvle, uniforms, &block[0], n, jobs, &stats) ? -1 : rc;
+			for (size_t i = 0; rc >= 0 && !quiet && i < n; i ++)
+			{
+				printBatch(dvle, block[i], first);
+				first += block[i].count;
+			}
+		}
+		if (rc == 2 && applyUpdate(dvle, uniforms, update, filename, lineNo) != 0)
+			rc = -1;
+	} while (rc > 0);
+
+	if (f != stdin)
+		fclose(f);
+	return rc < 0 ? 1 : 0;
+}
+
+static double wallTime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Times the interpreter, the translated batch path and native code over a
+// stream file
+static int runBench(const SimProgram& prog, const SimDvle& dvle, const SimInputs& in, const char* filename, int reps, int jobs)
+{
+	FILE* f = openStream(filename);
+	if (!f)
+		return 1;
+
+	// Load the whole stream first so that parsing is not timed
+	std::vector<SimBatch> batches;
+	SimInputs vtx;
+	std::string update;
+	int rc, lineNo = 0;
+	while ((rc = nextVertex(f, filename, lineNo, dvle, vtx, update)) > 0)
+	{
+		if (rc == 2)
+		{
+			fprintf(stderr, "%s:%d: error: --bench does not support uniform updates\n", filename, lineNo);
+			rc = -1;
+			break;
+		}
+		if (batches.empty() || batches.back().count == SIM_LANES)
+			batches.push_back(SimBatch());
+		SimBatch& batch = batches.back();
+		setLane(batch, batch.count++, vtx.v);
+	}
+	if (f != stdin)
+		fclose(f);
+	if (rc)
+		return 1;
+
+	if (batches.empty())
+	{
+		fprintf(stderr, "error: %s contains no vertices\n", filename);
+		return 1;
+	}
+
+	static const char* const modeNames[] = { "interpreter", "translated", "native" };
+	double times[3];
+	SimTranslate(prog);
+	int modes = g_simJit && SimCompile(prog) ? 3 : 2;
+
+	for (int mode = 0; mode < modes; mode ++)
+	{
+		g_simScalar = mode == 0;
+		g_simJit = mode == 2;
+		SimStats stats;
+		double start = wallTime();
+		for (int r = 0; r < reps; r ++)
+			if (SimRunBatches(prog, dvle, in, &batches[0], batches.size(), jobs, &stats) != 0)
+				return 1;
+		times[mode] = wallTime() - start;
+
+		double t = times[mode] > 0 ? times[mode] : 1e-9;
+		printf("%-12s %llu vertices in %.3f s (%.2f M vertices/s, %.1f M instructions/s)\n", modeNames[mode],
+			(unsigned long long)stats.vertexCount, times[mode], stats.vertexCount / t / 1e6, stats.insnCount / t / 1e6);
+	}
+
+	for (int mode = 1; mode < modes; mode ++)
+		if (times[mode] > 0)
+			printf("speedup of %s: %.2fx\n", modeNames[mode], times[0] / times[mode]);
+	if (modes < 3)
+		printf("native code is not available\n");
+	return 0;
+}
+
+// Mean, standard deviation and range of a series of values
+struct SimSummary
+{
+	u64 n;
+	double mean, m2, lo, hi;
+
+	SimSummary() : n(0), mean(0), m2(0), lo(0), hi(0) { }
+
+	void add(double x)
+	{
+		n ++;
+		double d = x - mean;
+		mean += d / n;
+		m2 += d * (x - mean);
+		lo = n == 1 ? x : std::min(lo, x);
+		hi = n == 1 ? x : std::max(hi, x);
+	}
+
+	double stddev() const { return n > 1 ? sqrt(m2 / (n-1)) : 0.0; }
+};
+
+static void printSummary(const char* name, const SimSummary& s)
+{
+	printf("%-18s %12.2f %10.2f %10.0f %10.0f\n", name, s.mean, s.stddev(), s.lo, s.hi);
+}
+
+static void printDifference(const char* name, const SimSummary& d, const SimSummary& a)
+{
+	double margin = d.n ? 1.96 * d.stddev() / sqrt((double)d.n) : 0.0;
+	printf("%-18s %12.2f %10.2f %10.0f %10.0f", name, d.mean, d.stddev(), d.lo, d.hi);
+	if (a.mean)
+		printf("   %+.2f%%", 100.0 * d.mean / a.mean);
+	printf(", 95%% CI %.2f .. %.2f\n", d.mean - margin, d.mean + margin);
+}
+
+#define OUTPUT_KEYS (10*4)
+
+// Register and component holding each output semantic (type*4 + component), or -1
+static void outputMap(const SimDvle& dvle, int map[OUTPUT_KEYS])
+{
+	for (int k = 0; k < OUTPUT_KEYS; k ++)
+		map[k] = -1;
+	for (size_t i = 0; i < dvle.outputs.size(); i ++)
+	{
+		u64 x = dvle.outputs[i];
+		int type = x & 0xFFFF, reg = (x >> 16) & 0xF, mask = (x >> 32) & 0xF;
+		for (int k = 0; type < 10 && k < 4; k ++)
+			if (mask & BIT(k))
+				map[type*4 + k] = reg*4 + k;
+	}
+}
+
+static const char* outputName(int key)
+{
+	static char buf[32];
+	snprintf(buf, sizeof(buf), "%s.%c", outTypeNames[key/4], "xyzw"[key%4]);
+	return buf;
+}
+
+// Values match when they are at most the given number of f24 ulps apart
+static inline bool sameValue(float a, float b, int ulps)
+{
+	if (a == b || (a != a && b != b))
+		return true;
+	return fabsf(a - b) <= ulps * std::max(fabsf(a), fabsf(b)) / 65536.0f;
+}
+
+// Describes the first output semantic with different values, if any
+static bool diffOutputs(const int mapA[OUTPUT_KEYS], const float a[16][4], const int mapB[OUTPUT_KEYS], const float b[16][4], int ulps, char* what, size_t size)
+{
+	for (int k = 0; k < OUTPUT_KEYS; k ++)
+	{
+		if (mapA[k] < 0 || mapB[k] < 0)
+			continue;
+		float x = a[mapA[k]/4][mapA[k]%4], y = b[mapB[k]/4][mapB[k]%4];
+		if (!sameValue(x, y, ulps))
+		{
+			snprintf(what, size, "%s differs (A %f, B %f)", outputName(k), x, y);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs every vertex of a stream file through two programs, comparing their
+// outputs and the instructions and cycles they take
+static int runCompare(const SimProgram& progA, const SimDvle& dvleA, const SimInputs& inA,
+	const SimProgram& progB, const SimDvle& dvleB, const SimInputs& inB, const char* filename, int ulps)
+{
+	FILE* f = openStream(filename);
+	if (!f)
+		return 1;
+
+	int mapA[OUTPUT_KEYS], mapB[OUTPUT_KEYS];
+	outputMap(dvleA, mapA);
+	outputMap(dvleB, mapB);
+	bool differ = false;
+	for (int k = 0; k < OUTPUT_KEYS; k ++)
+		if ((mapA[k] < 0) != (mapB[k] < 0))
+		{
+			printf("output %s is only written by %c\n", outputName(k), mapA[k] < 0 ? 'B' : 'A');
+			differ = true;
+		}
+
+	SimInputs vtx, uniA = inA, uniB = inB;
+	SimOutputs outA, outB;
+	SimSummary insnA, insnB, insnDiff, cycA, cycB, cycDiff;
+	std::string update;
+	u64 vertex = 0, updates = 0, mismatches = 0;
+	int rc, lineNo = 0;
+
+	while ((rc = nextVertex(f, filename, lineNo, dvleA, vtx, update)) > 0)
+	{
+		if (rc == 2)
+		{
+			// Uniforms are looked up separately, as their registers may differ
+			if (applyUpdate(dvleA, uniA, update, filename, lineNo) != 0 || applyUpdate(dvleB, uniB, update, filename, lineNo) != 0)
+			{
+				rc = -1;
+				break;
+			}
+			updates ++;
+			continue;
+		}
+
+		SimStats sa, sb;
+		memcpy(uniA.v, vtx.v, sizeof(vtx.v));
+		memcpy(uniB.v, vtx.v, sizeof(vtx.v));
+		if (SimRun(progA, dvleA, uniA, outA, &sa) != 0 || SimRun(progB, dvleB, uniB, outB, &sb) != 0)
+		{
+			fprintf(stderr, "%s:%d: error: cannot run vertex %llu\n", filename, lineNo, (unsigned long long)vertex);
+			rc = -1;
+			break;
+		}
+
+		insnA.add(sa.insnCount);
+		insnB.add(sb.insnCount);
+		insnDiff.add((double)sb.insnCount - (double)sa.insnCount);
+		cycA.add(sa.cycleCount);
+		cycB.add(sb.cycleCount);
+		cycDiff.add((double)sb.cycleCount - (double)sa.cycleCount);
+
+		char what[128] = "";
+		bool bad;
+		if (dvleA.isGeoShader)
+		{
+			bad = outA.emitted.size() != outB.emitted.size();
+			if (bad)
+				snprintf(what, sizeof(what), "emits %u vertices in A, %u in B", (unsigned)outA.emitted.size(), (unsigned)outB.emitted.size());
+			for (size_t i = 0; !bad && i < outA.emitted.size(); i ++)
+			{
+				const SimEmit& a = outA.emitted[i];
+				const SimEmit& b = outB.emitted[i];
+				bad = a.vertexId != b.vertexId || a.primEmit != b.primEmit || a.winding != b.winding;
+				if (bad)
+					snprintf(what, sizeof(what), "emit %u: different setemit flags", (unsigned)i);
+				else
+					bad = diffOutputs(mapA, a.o, mapB, b.o, ulps, what, sizeof(what));
+			}
+		} else
+			bad = diffOutputs(mapA, outA.o, mapB, outB.o, ulps, what, sizeof(what));
+
+		if (bad && ++mismatches <= 10)
+			printf("vertex %llu: %s\n", (unsigned long long)vertex, what);
+		vertex ++;
+	}
+
+	if (f != stdin)
+		fclose(f);
+	if (rc < 0)
+		return 1;
+
+	printf("%llu vertices, %llu uniform updates\n\n", (unsigned long long)vertex, (unsigned long long)updates);
+	printf("%-18s %12s %10s %10s %10s\n", "per vertex", "mean", "stddev", "min", "max");
+	printSummary("A instructions", insnA);
+	printSummary("B instructions", insnB);
+	printDifference("B-A instructions", insnDiff, insnA);
+	printSummary("A cycles", cycA);
+	printSummary("B cycles", cycB);
+	printDifference("B-A cycles", cycDiff, cycA);
+	printf("\n");
+
+	if (mismatches)
+		printf("outputs: %llu of %llu vertices differ\n", (unsigned long long)mismatches, (unsigned long long)vertex);
+	else
+		printf("outputs: all vertices match within %d ulp%s\n", ulps, ulps == 1 ? "" : "s");
+	return mismatches || differ ? 2 : 0;
+}
+
+static const SourceLoc* lineOf(const SimLineTable& lines, size_t pc)
+{
+	if (pc >= lines.locs.size() || lines.locs[pc].file < 0 || lines.locs[pc].file >= (int)lines.files.size())
+		return NULL;
+	return &lines.locs[pc];
+}
+
+static const char* procOf(const SimLineTable& lines, size_t pc)
+{
+	if (pc >= lines.owners.size() || lines.owners[pc] < 0 || lines.owners[pc] >= (int)lines.procs.size())
+		return "-";
+	return lines.procs[lines.owners[pc]].c_str();
+}
+
+// Machine-readable profile, one line per program word
+static int writeProfile(const SimProgram& prog, const SimStats& stats, const SimLineTable& lines, const char* filename)
+{
+	FILE* f = fopen(filename, "w");
+	if (!f)
+	{
+		fprintf(stderr, "error: cannot open profile file: %s\n", filename);
+		return 1;
+	}
+
+	fprintf(f, "# pc\tword\tcount\ttaken\tnot_taken\tloops\ttrips\tmax_depth\tfile\tline\tproc\n");
+	for (size_t pc = 0; pc < prog.code.size() && pc < stats.profile.size(); pc ++)
+	{
+		const SimProfileEntry& p = stats.profile[pc];
+		const SourceLoc* loc = lineOf(lines, pc);
+		fprintf(f, "%u\t%08X\t%llu\t%llu\t%llu\t%llu\t%llu\t%d\t%s\t%d\t%s\n", (unsigned)pc, prog.code[pc],
+			(unsigned long long)p.count, (unsigned long long)p.taken, (unsigned long long)p.notTaken,
+			(unsigned long long)p.loops, (unsigned long long)p.trips, p.maxDepth,
+			loc ? lines.files[loc->file].c_str() : "-", loc ? loc->line : 0, procOf(lines, pc));
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void printProfileLine(const SimProfileEntry* p, const char* text)
+{
+	char branches[48] = "", trips[32] = "";
+	if (p && (p->taken || p->notTaken))
+		snprintf(branches, sizeof(branches), "%llu/%llu", (unsigned long long)p->taken, (unsigned long long)p->notTaken);
+	if (p && p->loops)
+		snprintf(trips, sizeof(trips), "%.1f", (double)p->trips / p->loops);
+
+	if (p)
+		printf("%10llu %15s %7s %5d | %s\n", (unsigned long long)p->count, branches, trips, p->maxDepth, text);
+	else
+		printf("%10s %15s %7s %5s | %s\n", "", "", "", "", text);
+}
+
+// Prints each source file with the counts of the words assembled from each line
+static void printAnnotated(const SimProgram& prog, const SimStats& stats, const SimLineTable& lines)
+{
+	printf("%10s %15s %7s %5s |\n", "count", "taken/not", "trips", "depth");
+
+	if (lines.files.empty())
+	{
+		// No line table, list the program words instead
+		for (size_t pc = 0; pc < prog.code.size() && pc < stats.profile.size(); pc ++)
+		{
+			char text[32];
+			snprintf(text, sizeof(text), "%4u: %08X", (unsigned)pc, prog.code[pc]);
+			printProfileLine(&stats.profile[pc], text);
+		}
+		return;
+	}
+
+	for (size_t file = 0; file < lines.files.size(); file ++)
+	{
+		std::map<int, SimProfileEntry> byLine;
+		for (size_t pc = 0; pc < stats.profile.size(); pc ++)
+		{
+			const SourceLoc* loc = lineOf(lines, pc);
+			if (!loc || loc->file != (int)file)
+				continue;
+
+			// Words of a line share its counts; branches and loops add up
+			SimProfileEntry& e = byLine[loc->line];
+			const SimProfileEntry& p = stats.profile[pc];
+			e.count = std::max(e.count, p.count);
+			e.taken += p.taken;
+			e.notTaken += p.notTaken;
+			e.loops += p.loops;
+			e.trips += p.trips;
+			e.maxDepth = std::max(e.maxDepth, p.maxDepth);
+		}
+		if (byLine.empty())
+			continue;
+
+		const std::string& name = lines.files[file];
+		printf("\n%s:\n", name.c_str());
+
+		FILE* f = fopen(name.c_str(), "r");
+		if (!f)
+		{
+			fprintf(stderr, "warning: cannot open source file: %s\n", name.c_str());
+			for (std::map<int, SimProfileEntry>::iterator it = byLine.begin(); it != byLine.end(); ++it)
+			{
+				char text[32];
+				snprintf(text, sizeof(text), "line %d", it->first);
+				printProfileLine(&it->second, text);
+			}
+			continue;
+		}
+
+		char text[1024];
+		for (int lineNo = 1; fgets(text, sizeof(text), f); lineNo ++)
+		{
+			text[strcspn(text, "\r\n")] = 0;
+			std::map<int, SimProfileEntry>::iterator it = byLine.find(lineNo);
+			printProfileLine(it != byLine.end() ? &it->second : NULL, text);
+		}
+		fclose(f);
+	}
+
+	// Instructions executed within each procedure (not counting its callees)
+	if (lines.procs.empty())
+		return;
+	std::vector<u64> procCounts(lines.procs.size());
+	for (size_t pc = 0; pc < stats.profile.size() && pc < lines.owners.size(); pc ++)
+		if (lines.owners[pc] >= 0 && lines.owners[pc] < (int)procCounts.size())
+			procCounts[lines.owners[pc]] += stats.profile[pc].count;
+
+	printf("\n%10s %6s | procedure\n", "count", "%");
+	for (size_t i = 0; i < procCounts.size(); i ++)
+		if (procCounts[i])
+			printf("%10llu %5.1f%% | %s\n", (unsigned long long)procCounts[i],
+				stats.insnCount ? 100.0 * procCounts[i] / stats.insnCount : 0.0, lines.procs[i].c_str());
+}
+
+typedef std::vector<std::pair<bool, char*> > simAssignmentList; // (is file, text)
+
+// Loads a SHBIN file and sets up the inputs of one of its DVLEs
+static int loadProgram(const char* filename, int entry, const simAssignmentList& assignments, SimProgram& prog, SimInputs& in)
+{
+	safe_call(SimLoadShbin(filename, prog));
+
+	if (entry < 0 || entry >= (int)prog.dvles.size())
+	{
+		fprintf(stderr, "error: DVLE %d does not exist (%s has %d)\n", entry, filename, (int)prog.dvles.size());
+		return 1;
+	}
+
+	const SimDvle& dvle = prog.dvles[entry];
+	SimApplyConstants(dvle, in);
+
+	// Assignments are parsed in place, so work on a copy
+	for (size_t i = 0; i < assignments.size(); i ++)
+	{
+		if (assignments[i].first)
+			safe_call(parseFile(dvle, in, assignments[i].second));
+		else
+		{
+			std::vector<char> text(assignments[i].second, assignments[i].second + strlen(assignments[i].second) + 1);
+			safe_call(parseAssignment(dvle, in, &text[0]));
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int entry = 0;
+	char* streamFile = NULL;
+	char *profileFile = NULL, *linesFile = NULL, *compareFile = NULL;
+	int tolerance = 1;
+	bool quiet = false, annotate = false;
+	int benchReps = 0, jobs = 1;
+	simAssignmentList assignments;
+
+	static struct option long_options[] =
+	{
+		{ "entry",     required_argument, NULL, 'e' },
+		{ "set",       required_argument, NULL, 's' },
+		{ "file",      required_argument, NULL, 'f' },
+		{ "inputs",    required_argument, NULL, 'i' },
+		{ "scalar",    no_argument,       NULL, 'S' },
+		{ "no-jit",    no_argument,       NULL, 'J' },
+		{ "quiet",     no_argument,       NULL, 'q' },
+		{ "bench",     required_argument, NULL, 'b' },
+		{ "jobs",      required_argument, NULL, 'j' },
+		{ "profile",   required_argument, NULL, 'p' },
+		{ "annotate",  no_argument,       NULL, 'a' },
+		{ "lines",     required_argument, NULL, 'l' },
+		{ "compare",   required_argument, NULL, 'c' },
+		{ "tolerance", required_argument, NULL, 'T' },
+		{ "latency",   required_argument, NULL, 'L' },
+		{ "max-steps", required_argument, NULL, 'm' },
+		{ "trace",     no_argument,       NULL, 't' },
+		{ "help",      no_argument,       NULL, '?' },
+		{ "version",   no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int opt, optidx = 0;
+	while ((opt = getopt_long(argc, argv, "e:s:f:i:SJqb:j:p:al:c:T:L:m:t?v", long_options, &optidx)) != -1)
+	{
+		switch (opt)
+		{
+			case 'e': entry = atoi(optarg); break;
+			case 's': assignments.push_back(std::make_pair(false, optarg)); break;
+			case 'f': assignments.push_back(std::make_pair(true, optarg)); break;
+			case 'i': streamFile = optarg; break;
+			case 'S': g_simScalar = true; break;
+			case 'J': g_simJit = false; break;
+			case 'q': quiet = true; break;
+			case 'b': benchReps = atoi(optarg); break;
+			case 'j': jobs = atoi(optarg); break;
+			case 'p': profileFile = optarg; break;
+			case 'a': annotate = true; break;
+			case 'l': linesFile = optarg; break;
+			case 'c': compareFile = optarg; break;
+			case 'T': tolerance = atoi(optarg); break;
+			case 'L':
+				if (LoadLatencyTable(optarg) != 0)
+					return EXIT_FAILURE;
+				g_simLatency = GetLatencyTable();
+				break;
+			case 'm': g_simMaxSteps = strtoull(optarg, NULL, 0); break;
+			case 't': g_simTrace = true; break;
+			case '?': usage(argv[0]); return EXIT_SUCCESS;
+			case 'v': printf("%s - Built on %s %s\n", PACKAGE_STRING, __DATE__, __TIME__); return EXIT_SUCCESS;
+			default:  return usage(argv[0]);
+		}
+	}
+
+	if (optind != argc-1)
+	{
+		fprintf(stderr, "%s: exactly one SHBIN file must be specified\n", argv[0]);
+		return usage(argv[0]);
+	}
+
+	SimProgram prog;
+	SimInputs in;
+	if (loadProgram(argv[optind], entry, assignments, prog, in) != 0)
+		return EXIT_FAILURE;
+
+	SimLineTable lines;
+	if (linesFile && SimLoadLineTable(linesFile, lines) != 0)
+		return EXIT_FAILURE;
+
+	const SimDvle& dvle = prog.dvles[entry];
+
+	if (compareFile)
+	{
+		if (!streamFile)
+		{
+			fprintf(stderr, "%s: --compare requires a vertex stream (--inputs)\n", argv[0]);
+			return usage(argv[0]);
+		}
+
+		SimProgram progB;
+		SimInputs inB;
+		if (loadProgram(compareFile, entry, assignments, progB, inB) != 0)
+			return EXIT_FAILURE;
+
+		g_simLatency = GetLatencyTable();
+		printf("A: %s, DVLE %d\nB: %s, DVLE %d\n", argv[optind], entry, compareFile, entry);
+		return runCompare(prog, dvle, in, progB, progB.dvles[entry], inB, streamFile, tolerance) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (benchReps > 0)
+	{
+		if (!streamFile)
+		{
+			fprintf(stderr, "%s: --bench requires a vertex stream (--inputs)\n", argv[0]);
+			return usage(argv[0]);
+		}
+		return runBench(prog, dvle, in, streamFile, benchReps, jobs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	SimStats stats;
+	if (profileFile || annotate)
+		stats.profile.resize(prog.code.size());
+
+	if (streamFile)
+	{
+		if (runStream(prog, dvle, in, streamFile, quiet, jobs, stats) != 0)
+			return EXIT_FAILURE;
+		printf("%llu vertices, %llu instructions executed", (unsigned long long)stats.vertexCount, (unsigned long long)stats.insnCount);
+		if (g_simLatency)
+			printf(", %llu cycles", (unsigned long long)stats.cycleCount);
+		if (stats.scalarFallbacks)
+			printf(" (%llu batches run one vertex at a time)", (unsigned long long)stats.scalarFallbacks);
+		printf("\n");
+	} else
+	{
+		SimOutputs out;
+		if (SimRun(prog, dvle, in, out, &stats) != 0)
+			return EXIT_FAILURE;
+
+		if (dvle.isGeoShader && !quiet)
+		{
+			for (size_t i = 0; i < out.emitted.size(); i ++)
+			{
+				SimEmit& e = out.emitted[i];
+				printf("emit %u: vertex %d%s%s\n", (unsigned)i, e.vertexId, e.primEmit ? ", primitive" : "", e.winding ? ", inverted" : "");
+				printOutputs(dvle, e.o, "  ");
+			}
+		} else if (!quiet)
+			printOutputs(dvle, out.o, "");
+
+		printf("%llu instructions executed", (unsigned long long)stats.insnCount);
+		if (g_simLatency)
+			printf(", %llu cycles", (unsigned long long)stats.cycleCount);
+		printf("\n");
+	}
+
+	if (profileFile && writeProfile(prog, stats, lines, profileFile) != 0)
+		return EXIT_FAILURE;
+	if (annotate)
+		printAnnotated(prog, stats, lines);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,401 @@
+#include "picasso_sim.h"
+
+// --------------------------------------------------------------------
+// Native code generation
+// --------------------------------------------------------------------
+
+// Runs of ALU instructions without relative addressing are compiled to x86-64
+// SSE code working on 4 lanes at a time. Swizzles, negation and write masks
+// are resolved while generating the code. Each result is rounded to f24 the
+// same way as f24round, so the results match the interpreter exactly.
+
+bool g_simJit = true;
+
+#ifdef SIM_HAVE_JIT
+#include <sys/mman.h>
+
+// Compiled programs, by program hash
+static std::map<u64, SimJitCode> simJitCache;
+
+// Constants read by the generated code, at the start of the code buffer
+enum
+{
+	JC_SIGN, JC_ABS, JC_TRUNC, JC_UNDER, JC_EXP, JC_EXP_BE, JC_EXP_BF, JC_KEEP, JC_INF, JC_ONE,
+	JC_COUNT
+};
+
+static const u32 jitConsts[JC_COUNT] =
+{
+	0x80000000, 0x7FFFFFFF, 0xFFFFFF80, 0x20000000, 0xFF, 0xBE, 0xBF, 0x807FFFFF, 0x7F800000, 0x3F800000,
+};
+
+// Registers holding the arguments of SimJitFunc (System V ABI)
+enum { GP_CX = 1, GP_DX = 2, GP_SI = 6, GP_DI = 7 };
+
+// Scratch registers; xmm8-xmm11 hold the result components
+enum { X0, X1, X2, X3, X4, X5, X6, X7, XR };
+
+// SSE opcodes (second byte after 0F)
+enum
+{
+	SSE_MOVUPS = 0x10, SSE_MOVUPS_ST = 0x11, SSE_MOVAPS = 0x28, SSE_SQRTPS = 0x51,
+	SSE_ANDPS = 0x54, SSE_ANDNPS = 0x55, SSE_ORPS = 0x56, SSE_XORPS = 0x57,
+	SSE_ADDPS = 0x58, SSE_MULPS = 0x59, SSE_MINPS = 0x5D, SSE_DIVPS = 0x5E, SSE_MAXPS = 0x5F,
+	SSE_PCMPGTD = 0x66, SSE_PSRLD = 0x72, SSE_CMPPS = 0xC2, SSE_SHUFPS = 0xC6,
+};
+
+// Predicates of CMPPS
+enum { CMP_LT = 1, CMP_LE = 2, CMP_UNORD = 3, CMP_ORD = 7 };
+
+struct SimJitEmitter
+{
+	std::vector<u8> buf;
+
+	void byte(u8 x) { buf.push_back(x); }
+
+	void dword(u32 x)
+	{
+		for (int i = 0; i < 4; i ++)
+			byte(x >> (8*i));
+	}
+
+	void prefix(u8 pfx, int reg, int rm)
+	{
+		if (pfx)
+			byte(pfx);
+		if (reg >= 8 || rm >= 8)
+			byte(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+		byte(0x0F);
+	}
+
+	// op xmm, xmm
+	void rr(u8 pfx, u8 op, int reg, int rm)
+	{
+		prefix(pfx, reg, rm);
+		byte(op);
+		byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+	}
+
+	// op xmm, [base+disp32] or the reverse for stores
+	void rm(u8 pfx, u8 op, int reg, int base, u32 disp)
+	{
+		prefix(pfx, reg, 0);
+		byte(op);
+		byte(0x80 | ((reg & 7) << 3) | base);
+		dword(disp);
+	}
+
+	// op xmm, [rip+constant]
+	void rc(u8 pfx, u8 op, int reg, int id)
+	{
+		prefix(pfx, reg, 0);
+		byte(op);
+		byte(0x05 | ((reg & 7) << 3));
+		dword(id*16 - (int)(buf.size() + 4));
+	}
+
+	void mov(int dst, int src) { if (dst != src) rr(0, SSE_MOVAPS, dst, src); }
+	void cmp(int dst, int src, int pred) { rr(0, SSE_CMPPS, dst, src); byte(pred); }
+
+	// Reads one component of a source operand for 4 lanes
+	void load(int x, const SimOpSrc& s, int k, int chunk)
+	{
+		if (s.reg < 0x20)
+		{
+			int base = s.reg < 0x10 ? GP_SI : GP_DI;
+			int reg = s.reg & 0xF;
+			rm(0, SSE_MOVUPS, x, base, ((reg*4 + s.sw[k])*SIM_LANES + chunk*4) * 4);
+		} else
+		{
+			// Uniforms are the same for every lane
+			rm(0xF3, SSE_MOVUPS, x, GP_CX, ((s.reg-0x20)*4 + s.sw[k]) * 4);
+			rr(0, SSE_SHUFPS, x, x);
+			byte(0);
+		}
+		if (s.neg)
+			rc(0, SSE_XORPS, x, JC_SIGN);
+	}
+
+	void store(int x, int dest, int k, int chunk)
+	{
+		int base = dest < 0x10 ? GP_DX : GP_DI;
+		rm(0, SSE_MOVUPS_ST, x, base, (((dest & 0xF)*4 + k)*SIM_LANES + chunk*4) * 4);
+	}
+
+	// x *= y, with 0 * inf giving 0 (uses X2 and X3)
+	void mul(int x, int y)
+	{
+		mov(X2, x);
+		cmp(X2, y, CMP_ORD);
+		rr(0, SSE_MULPS, x, y);
+		mov(X3, x);
+		cmp(X3, X3, CMP_UNORD);
+		rr(0, SSE_ANDPS, X3, X2);
+		rr(0, SSE_ANDNPS, X3, x);
+		mov(x, X3);
+	}
+
+	// Same as f24round (uses X4 to X7)
+	void round(int x)
+	{
+		mov(X4, x);
+		rc(0, SSE_ANDPS, X4, JC_TRUNC);
+		mov(X5, x);
+		rc(0, SSE_ANDPS, X5, JC_SIGN);
+		mov(X6, x);
+		prefix(0x66, 0, X6);
+		byte(SSE_PSRLD);
+		byte(0xC0 | (2 << 3) | (X6 & 7));
+		byte(23);
+		rc(0, SSE_ANDPS, X6, JC_EXP);
+
+		// Underflow gives a signed zero
+		mov(X7, X4);
+		rc(0, SSE_ANDPS, X7, JC_ABS);
+		rc(0x66, SSE_PCMPGTD, X7, JC_UNDER);
+		rr(0, SSE_ANDPS, X4, X7);
+		rr(0, SSE_ANDNPS, X7, X5);
+		rr(0, SSE_ORPS, X4, X7);
+
+		// Overflow saturates to infinity, infinity and NaN keep their mantissa
+		mov(X7, X6);
+		rc(0x66, SSE_PCMPGTD, X7, JC_EXP_BE);
+		rc(0x66, SSE_PCMPGTD, X6, JC_EXP_BF);
+		mov(x, X4);
+		rc(0, SSE_ANDPS, x, JC_KEEP);
+		rr(0, SSE_ANDPS, X5, X6);
+		rr(0, SSE_ANDNPS, X6, x);
+		rr(0, SSE_ORPS, X5, X6);
+		rc(0, SSE_ORPS, X5, JC_INF);
+		rr(0, SSE_ANDPS, X5, X7);
+		rr(0, SSE_ANDNPS, X7, X4);
+		rr(0, SSE_ORPS, X7, X5);
+		mov(x, X7);
+	}
+
+	void insn(const SimOp& o, int chunk);
+};
+
+static bool canCompile(const SimOp& o)
+{
+	switch (o.op)
+	{
+		case MAESTRO_ADD: case MAESTRO_MUL: case MAESTRO_MAD:
+		case MAESTRO_DP3: case MAESTRO_DP4: case MAESTRO_DPH: case MAESTRO_DST:
+		case MAESTRO_MAX: case MAESTRO_MIN: case MAESTRO_SGE: case MAESTRO_SLT:
+		case MAESTRO_RCP: case MAESTRO_RSQ: case MAESTRO_MOV:
+			break;
+		default:
+			return false;
+	}
+	for (int i = 0; i < o.srcCount; i ++)
+		if (o.src[i].idx)
+			return false;
+	return true;
+}
+
+void SimJitEmitter::insn(const SimOp& o, int chunk)
+{
+	const SimOpSrc* s = o.src;
+	bool splat = false;
+
+	switch (o.op)
+	{
+		case MAESTRO_DP3:
+		case MAESTRO_DP4:
+		case MAESTRO_DPH:
+			for (int k = 0; k < (o.op == MAESTRO_DP4 ? 4 : 3); k ++)
+			{
+				int x = k ? X0 : XR;
+				load(x, s[0], k, chunk);
+				load(X1, s[1], k, chunk);
+				mul(x, X1);
+				if (k)
+					rr(0, SSE_ADDPS, XR, X0);
+			}
+			if (o.op == MAESTRO_DPH)
+			{
+				load(X1, s[1], 3, chunk);
+				rr(0, SSE_ADDPS, XR, X1);
+			}
+			splat = true;
+			break;
+		case MAESTRO_RCP:
+		case MAESTRO_RSQ:
+			load(X0, s[0], 0, chunk);
+			if (o.op == MAESTRO_RSQ)
+				rr(0, SSE_SQRTPS, X0, X0);
+			rc(0, SSE_MOVAPS, XR, JC_ONE);
+			rr(0, SSE_DIVPS, XR, X0);
+			splat = true;
+			break;
+		default:
+			// Component-wise, all of the result is computed before it is stored
+			// as the destination may also be a source
+			for (int k = 0; k < 4; k ++)
+			{
+				int x = XR + k;
+				if (!(o.mask & BIT(3-k)))
+					continue;
+				switch (o.op)
+				{
+					case MAESTRO_ADD:
+						load(x, s[0], k, chunk);
+						load(X1, s[1], k, chunk);
+						rr(0, SSE_ADDPS, x, X1);
+						break;
+					case MAESTRO_MUL:
+						load(x, s[0], k, chunk);
+						load(X1, s[1], k, chunk);
+						mul(x, X1);
+						break;
+					case MAESTRO_MAD:
+						load(x, s[0], k, chunk);
+						load(X1, s[1], k, chunk);
+						mul(x, X1);
+						load(X1, s[2], k, chunk);
+						rr(0, SSE_ADDPS, x, X1);
+						break;
+					case MAESTRO_DST:
+						if (k == 0)
+							rc(0, SSE_MOVAPS, x, JC_ONE);
+						else if (k == 1)
+						{
+							load(x, s[0], 1, chunk);
+							load(X1, s[1], 1, chunk);
+							mul(x, X1);
+						} else
+							load(x, s[k == 2 ? 0 : 1], k, chunk);
+						break;
+					case MAESTRO_MAX:
+					case MAESTRO_MIN:
+						load(x, s[0], k, chunk);
+						load(X1, s[1], k, chunk);
+						rr(0, o.op == MAESTRO_MAX ? SSE_MAXPS : SSE_MINPS, x, X1);
+						break;
+					case MAESTRO_SGE:
+						// s2 <= s1, false for NaN like s1 >= s2
+						load(X0, s[0], k, chunk);
+						load(x, s[1], k, chunk);
+						cmp(x, X0, CMP_LE);
+						rc(0, SSE_ANDPS, x, JC_ONE);
+						break;
+					case MAESTRO_SLT:
+						load(x, s[0], k, chunk);
+						load(X1, s[1], k, chunk);
+						cmp(x, X1, CMP_LT);
+						rc(0, SSE_ANDPS, x, JC_ONE);
+						break;
+					case MAESTRO_MOV:
+						load(x, s[0], k, chunk);
+						break;
+				}
+			}
+			break;
+	}
+
+	if (splat)
+		round(XR);
+	for (int k = 0; k < 4; k ++)
+	{
+		if (!(o.mask & BIT(3-k)))
+			continue;
+		if (!splat)
+			round(XR + k);
+		store(splat ? XR : XR + k, o.dest, k, chunk);
+	}
+}
+
+// Runs must not span the start or end of a block, or a jump target, since
+// the interpreter checks for these before each instruction
+static void findBoundaries(const SimProgram& prog, std::vector<bool>& boundary)
+{
+	size_t size = prog.code.size();
+	boundary.assign(size+2, false);
+	for (size_t i = 0; i < prog.dvles.size(); i ++)
+		if (prog.dvles[i].entryStart <= size)
+			boundary[prog.dvles[i].entryStart] = true;
+
+	for (size_t pc = 0; pc < size; pc ++)
+	{
+		u32 w = prog.code[pc];
+		int op = w >> 26;
+		if (op < 0x20 || op >= MAESTRO_CMP)
+			continue;
+		size_t dst = (w>>10) & 0xFFF, num = w & 0x3FF;
+		size_t targets[] = { pc+1, dst, dst+1, dst+num };
+		for (int i = 0; i < 4; i ++)
+			if (targets[i] <= size)
+				boundary[targets[i]] = true;
+	}
+}
+
+const SimJitCode* SimCompile(const SimProgram& prog)
+{
+	if (!g_simJit)
+		return NULL;
+
+	std::map<u64, SimJitCode>::iterator it = simJitCache.find(prog.hash);
+	if (it != simJitCache.end())
+		return &it->second;
+
+	const SimCode& code = SimTranslate(prog);
+	SimJitCode& jit = simJitCache[prog.hash];
+	jit.length.assign(code.size(), 0);
+	jit.entry.assign(code.size(), (SimJitFunc)NULL);
+
+	std::vector<bool> boundary;
+	findBoundaries(prog, boundary);
+
+	SimJitEmitter e;
+	for (int i = 0; i < JC_COUNT; i ++)
+		for (int j = 0; j < 4; j ++)
+			e.dword(jitConsts[i]);
+
+	std::vector<size_t> offsets(code.size(), 0);
+	for (size_t pc = 0; pc < code.size(); )
+	{
+		size_t end;
+		for (end = pc; end < code.size() && canCompile(code[end]) && (end == pc || !boundary[end]); end ++);
+		if (end == pc)
+		{
+			pc ++;
+			continue;
+		}
+
+		while (e.buf.size() & 15)
+			e.byte(0x90);
+		offsets[pc] = e.buf.size();
+		for (int chunk = 0; chunk < SIM_LANES/4; chunk ++)
+			for (size_t i = pc; i < end; i ++)
+				e.insn(code[i], chunk);
+		e.byte(0xC3);
+		jit.length[pc] = end - pc;
+		pc = end;
+	}
+
+	void* mem = mmap(NULL, e.buf.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	memcpy(mem, &e.buf[0], e.buf.size());
+	if (mprotect(mem, e.buf.size(), PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(mem, e.buf.size());
+		return NULL;
+	}
+
+	for (size_t pc = 0; pc < code.size(); pc ++)
+		if (jit.length[pc])
+			jit.entry[pc] = (SimJitFunc)((u8*)mem + offsets[pc]);
+	jit.size = e.buf.size();
+	return &jit;
+}
+
+#else
+
+const SimJitCode* SimCompile(const SimProgram&)
+{
+	return NULL;
+}
+
+#endif